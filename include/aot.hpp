@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include "vm.hpp"
+
+// Ahead-of-time translation of an assembled program into one C++ translation unit.
+//
+// Every jump, call or return target becomes a C++ label and every instruction a
+// block of straight-line code with the same checks, in the same order, as
+// VM::vm_execute_inst, so an emitted program halts or traps exactly where the
+// interpreter does. ret dispatches through a switch over the return sites. The
+// output includes aot_runtime.hpp and links against libbm:
+//
+//     c++ -std=c++17 -O3 -I<bm>/include prog.cpp -lbm -lpthread
+//
+// Only natives from builtin_natives() are available. Breakpoints, fiber and heap
+// instructions are not supported; translating them fails with an error.
+[[nodiscard]] bool aot_emit_cpp(const VM &, std::ostream &, std::string &error);
+
+// bm --aot-check: run the program on the interpreter, emit, compile and run it,
+// and compare printed output and final state. Reports to log.
+[[nodiscard]] bool aot_check(const VM &, uint64_t max_steps, std::ostream &log);
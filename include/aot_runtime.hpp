@@ -0,0 +1,42 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+#include "output.hpp"
+#include "vm.hpp"
+
+// Support code linked into programs emitted by `bm --emit-cpp` (see aot.hpp).
+//
+// The emitted program keeps its stacks in fixed local arrays. The interpreter's
+// stacks grow without bound, so a program that outgrows these traps with
+// TRAP_STACK_OVERFLOW instead; define the macros when compiling to change them.
+
+#ifndef BM_AOT_STACK_SIZE
+#define BM_AOT_STACK_SIZE 65536 // Values on the operand stack
+#endif
+
+#ifndef BM_AOT_CALL_DEPTH
+#define BM_AOT_CALL_DEPTH 65536 // Return addresses, and frames for programs that use enter
+#endif
+
+// Final state of a run, in the same terms as the VM's
+struct Aot_result {
+    Trap trap{Trap::TRAP_OK};
+    i64 ip{};
+    std::vector<f64> stack{};
+    std::vector<i64> call_stack{};
+};
+
+struct Aot_runtime {
+    Output output{};
+    const std::vector<Native> &natives{builtin_natives()};
+};
+
+using Aot_program = void (*)(Aot_runtime &, Aot_result &);
+
+// main() of an emitted program: runs it and reports like bm does (stack dump on
+// halt, trap and state on stderr otherwise). `--result FILE` also writes the
+// final state with aot_write_result, which is what bm --aot-check compares.
+int aot_main(int argc, char *argv[], Aot_program);
+
+void aot_write_result(std::ostream &, const Aot_result &); // Exact: values are written as hex floats
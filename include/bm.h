@@ -0,0 +1,134 @@
+#ifndef BM_H
+#define BM_H
+
+/*
+ * libbm: embeddable C API for the Birtual Machine.
+ *
+ * A bm_program is an immutable assembled program that can be shared by any
+ * number of bm_context objects. A context holds one execution (stack, call
+ * stack, instruction pointer) and can be reset and reused between runs.
+ * No function exits the process; every failure is reported as a bm_status.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum bm_status {
+    BM_OK = 0,
+    BM_ERR_INVALID_ARG,
+    BM_ERR_ASSEMBLY,       /* Source failed to assemble, see the error buffer */
+    BM_ERR_IO,             /* Program file could not be read or written, or is malformed */
+    BM_ERR_OUT_OF_MEMORY,
+    BM_ERR_RANGE,          /* Stack index out of range */
+    BM_ERR_INTERNAL,
+    BM_STEP_LIMIT,         /* Step budget exhausted before the program halted */
+    BM_TRAPPED,            /* Program trapped, see bm_context_trap() */
+    BM_YIELDED,            /* Time slice expired or interrupted, call bm_run again to resume */
+} bm_status;
+
+/* Mirrors the VM's Trap codes */
+typedef enum bm_trap {
+    BM_TRAP_OK = 0,
+    BM_TRAP_STACK_OVERFLOW,
+    BM_TRAP_STACK_UNDERFLOW,
+    BM_TRAP_ILLEGAL_INST,
+    BM_TRAP_DIV_BY_ZERO,
+    BM_TRAP_ILLEGAL_INST_ACCESS,
+    BM_TRAP_BREAKPOINT,
+    BM_TRAP_FIBER,         /* Fiber instructions need the scheduler, which bm_run does not provide */
+    BM_TRAP_DEADLOCK,
+    BM_TRAP_ILLEGAL_MEMORY_ACCESS,
+    BM_TRAP_OUT_OF_MEMORY, /* alloc past the context's heap limit */
+} bm_trap;
+
+typedef struct bm_program bm_program;
+typedef struct bm_context bm_context;
+typedef struct bm_natives bm_natives;
+
+/*
+ * Host function called by `native NAME`. args holds the popped arguments (deepest
+ * first); write the declared number of results to results. Return BM_TRAP_OK, or
+ * an error trap (stack overflow/underflow, illegal instruction, division by zero,
+ * illegal instruction or memory access, out of memory) to stop the program with
+ * it. BM_TRAP_BREAKPOINT, BM_TRAP_FIBER, BM_TRAP_DEADLOCK and values outside the
+ * enum are reported as BM_TRAP_ILLEGAL_INST.
+ */
+typedef bm_trap (*bm_native_fn)(const double *args, double *results, void *user);
+
+const char *bm_status_str(bm_status status);
+const char *bm_trap_str(bm_trap trap);
+
+/* Assemble source text. On BM_ERR_ASSEMBLY a message is written to err when err_len > 0. */
+bm_status bm_program_assemble(const char *src, size_t src_len, bm_program **out, char *err, size_t err_len);
+/*
+ * Load a program written with `bm -o` or bm_program_save. The file holds the
+ * instructions and label table; opcodes, operands and label positions are
+ * validated, so a malformed file fails with BM_ERR_IO instead of being run.
+ */
+bm_status bm_program_load(const char *path, bm_program **out, char *err, size_t err_len);
+/* Write a program in the format bm_program_load reads */
+bm_status bm_program_save(const bm_program *program, const char *path, char *err, size_t err_len);
+
+/*
+ * A native function table, starting with the built-ins (sqrt, sin, cos, tan, exp,
+ * log, pow, floor, ceil, abs, min, max). Names are resolved when a program is
+ * assembled against the table and the program keeps its own copy, so the table can
+ * be changed or freed afterwards; user pointers must outlive the programs.
+ */
+bm_status bm_natives_create(bm_natives **out);
+void bm_natives_free(bm_natives *natives);
+/* Add a native, or replace one with the same name */
+bm_status bm_register_native(bm_natives *natives, const char *name, bm_native_fn fn, uint32_t arity,
+                             uint32_t results, void *user);
+/* Like bm_program_assemble/bm_program_load, but resolving `native` names against the given table */
+bm_status bm_program_assemble_with(const bm_natives *natives, const char *src, size_t src_len, bm_program **out,
+                                   char *err, size_t err_len);
+bm_status bm_program_load_with(const bm_natives *natives, const char *path, bm_program **out, char *err,
+                               size_t err_len);
+void bm_program_free(bm_program *program);
+
+/* Contexts keep a reference to their program, which must outlive them */
+bm_status bm_context_create(const bm_program *program, bm_context **out);
+void bm_context_free(bm_context *ctx);
+/* Clear the stacks and any pending bm_interrupt, and restart at the program entry point ("start" label, or 0) */
+bm_status bm_context_reset(bm_context *ctx);
+
+bm_status bm_push(bm_context *ctx, double value);
+/* Run until halt, trap or max_steps instructions; steps may be NULL */
+bm_status bm_run(bm_context *ctx, uint64_t max_steps, uint64_t *steps);
+/*
+ * Like bm_run, but also yields once max_micros have elapsed (0 means no limit).
+ * Time is only checked on backward branches and calls, so a slice can overrun
+ * by one basic block. A yielded context keeps all of its state.
+ */
+bm_status bm_run_slice(bm_context *ctx, uint64_t max_steps, uint64_t max_micros, uint64_t *steps);
+/* Make a running bm_run/bm_run_slice on ctx return BM_YIELDED; safe to call from any thread */
+void bm_interrupt(bm_context *ctx);
+bm_trap bm_context_trap(const bm_context *ctx);
+
+/*
+ * Where print_debug output goes, stdout by default. The context buffers output
+ * and calls fn with each chunk when the buffer fills or a run returns; a NULL
+ * fn discards output.
+ */
+typedef void (*bm_output_fn)(const char *data, size_t len, void *user);
+bm_status bm_set_output(bm_context *ctx, bm_output_fn fn, void *user);
+
+/* Cap on the bytes alloc can hand out (default 64 MiB); takes effect on the next alloc */
+bm_status bm_set_heap_limit(bm_context *ctx, size_t limit);
+/* The context's heap, valid until the next run or reset; size may be NULL */
+const uint8_t *bm_heap(const bm_context *ctx, size_t *size);
+
+size_t bm_stack_size(const bm_context *ctx);
+/* index 0 is the bottom of the stack */
+bm_status bm_stack_get(const bm_context *ctx, size_t index, double *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BM_H */
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include "vm.hpp"
+
+// Interactive debugger. Breakpoints are set by patching the target instruction
+// with INST_BREAK, so the VM runs at full speed between them.
+class Debugger final {
+private:
+    VM &m_vm;
+    std::unordered_map<i64, Instruction> m_breakpoints{}; // ip and the instruction patched over
+    std::atomic<bool> m_running{}; // Inside cont(), where interrupt() stops the VM
+
+    [[nodiscard]] bool resolve_addr(const std::string &, i64 &) const;
+    [[nodiscard]] std::string describe_addr(i64) const;
+
+    void print_location(std::ostream &) const;
+    void print_stack(std::ostream &) const;
+    void print_call_stack(std::ostream &) const;
+    void report(Trap, std::ostream &) const;
+
+public:
+    explicit Debugger(VM &);
+
+    bool set_breakpoint(i64);
+    bool clear_breakpoint(i64);
+
+    Trap step();     // Execute a single instruction, stepping over a breakpoint at ip
+    Run_result cont(); // Run until a breakpoint, trap, halt or interrupt() (RUN_YIELDED)
+
+    // For SIGINT/SIGTERM handlers (async-signal safe): stops a running continue and
+    // drops back to the prompt; at the prompt it only prints a reminder to use quit
+    void interrupt() noexcept;
+
+    void repl(std::istream &, std::ostream &);
+};
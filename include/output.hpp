@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+// Buffered program output for print_debug and stack dumps.
+//
+// Values are formatted with std::to_chars (same digits as the default iostream
+// formatting, without the locale) into a per-VM buffer that is written out in
+// one call when it fills up or on flush(). The buffer is allocated on the first
+// write, so VMs that never print do not pay for it. With a background writer,
+// flush() only copies the buffer into a lock-free single-producer ring and a
+// writer thread does the actual writes, so the VM only waits when the ring is
+// full. Both sides sleep on a condition variable rather than polling.
+
+enum class Output_format {
+    OUTPUT_TEXT,   // One value per line
+    OUTPUT_BINARY, // Raw native-endian doubles
+};
+
+// Receives each written chunk instead of a FILE, see Output::set_sink
+using Output_sink = void (*)(const char *data, size_t len, void *user);
+
+// Single-producer single-consumer byte ring
+class Byte_ring final {
+private:
+    std::unique_ptr<char[]> m_data;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_head{}; // Total bytes written by the producer
+    alignas(64) std::atomic<size_t> m_tail{}; // Total bytes read by the consumer
+
+public:
+    explicit Byte_ring(size_t capacity); // Rounded up to a power of two
+
+    // Both return how many bytes were transferred, possibly fewer than asked for
+    size_t push(const char *, size_t);
+    size_t pop(char *, size_t);
+    bool empty() const;
+    bool full() const;
+};
+
+class Output final {
+private:
+    std::FILE *m_file;
+    Output_sink m_sink{};
+    void *m_sink_user{};
+    Output_format m_format{Output_format::OUTPUT_TEXT};
+    std::unique_ptr<char[]> m_buffer{};
+    size_t m_size{};
+
+    std::unique_ptr<Byte_ring> m_ring{};
+    std::thread m_writer{};
+    std::mutex m_wait_mutex{};
+    std::condition_variable m_data_cv{};  // Writer waits for bytes or a stop request
+    std::condition_variable m_space_cv{}; // VM waits for room in a full ring
+    bool m_stop{};                        // Guarded by m_wait_mutex
+
+    char *buffer(); // Allocates on first use
+
+    void emit(const char *, size_t); // To the sink or file, from the VM or the writer thread
+    void write_out(const char *, size_t);
+    void writer_loop();
+
+public:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+    static constexpr size_t RING_SIZE = 1024 * 1024;
+
+    explicit Output(std::FILE *file = stdout);
+    ~Output(); // Flushes and stops the writer
+    Output(const Output &) = delete;
+    Output &operator=(const Output &) = delete;
+
+    // Both flush and stop a background writer first
+    void set_file(std::FILE *) &; // nullptr discards output
+    void set_sink(Output_sink, void *user) &; // Takes precedence over the file, a null sink goes back to it
+    void set_format(Output_format) &;
+    Output_format get_format() const&;
+
+    void start_writer(size_t ring_size = RING_SIZE);
+    void stop_writer(); // Drains the ring and joins the thread
+
+    void write_value(double);  // print_debug: a line of text, or 8 bytes in binary mode
+    void write_number(double); // Text digits only, whatever the format
+    void write(std::string_view);
+    void flush();
+};
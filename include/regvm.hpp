@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "vm.hpp"
+
+// Register-machine execution engine translated from the stack bytecode.
+//
+// Each basic block is translated once into three-address ops over a register
+// window based at the stack pointer the block was entered with: negative
+// registers are the values already on the stack (-1 is the top), non-negative
+// ones are the block's results and scratch temporaries. A block checks the
+// stack depth it needs once on entry instead of per instruction, and stack
+// shuffling (dup/swap/drop/push) mostly disappears into register renaming.
+//
+// Only instructions that cannot trap other than by underflow are translated.
+// Anything else ends the block and is executed by the stack VM, which stays
+// the reference: when a block's entry check fails or the step budget would be
+// exceeded, the engine single-steps the stack VM so traps and results match.
+
+enum class Reg_op : uint8_t {
+    REG_MOVE,
+    REG_CONST,
+    REG_ADD,
+    REG_SUB,
+    REG_MUL,
+    REG_EQ,
+    REG_NOT,
+    REG_XOR,
+    REG_AND,
+    REG_OR,
+};
+
+struct Reg_inst {
+    Reg_op op;
+    int32_t dst;
+    int32_t a;
+    int32_t b;
+    f64 imm;
+};
+
+enum class Reg_exit : uint8_t {
+    EXIT_FALLTHROUGH, // Continue with the block at `end`
+    EXIT_JUMP,        // Translated jmp to `taken`
+    EXIT_BRANCH,      // Translated jmp_if on register `cond`
+    EXIT_STACK,       // Execute the instruction at `end` on the stack VM
+};
+
+struct Reg_block {
+    i64 start;
+    i64 end;            // First instruction not translated into `code`
+    uint64_t count;     // Original instructions retired by code and a translated exit
+    int32_t need;       // Stack depth required on entry
+    int32_t grow;       // Window size above the entry stack pointer, results plus temporaries
+    int32_t net;        // Stack height change
+    std::vector<Reg_inst> code;
+    Reg_exit exit;
+    int32_t cond;
+    i64 taken;
+};
+
+class Reg_engine final {
+private:
+    std::vector<Instruction> m_program;
+    std::vector<i64> m_targets;       // Resolved label of each jmp/jmp_if, -1 if unresolved
+    std::vector<bool> m_leaders;
+    std::vector<std::unique_ptr<Reg_block>> m_blocks; // Indexed by start ip, filled lazily past the leaders
+
+    [[nodiscard]] std::unique_ptr<Reg_block> translate(i64) const;
+    const Reg_block &block_at(i64);
+    Run_result run_blocks(VM &, uint64_t max_steps);
+
+public:
+    explicit Reg_engine(const VM &);
+
+    // Same contract as VM::vm_run, minus the wall-clock limit. The trace shows the first
+    // instruction of each translated block and every instruction left to the stack engine.
+    Run_result run(VM &, uint64_t max_steps);
+
+    void dump(std::ostream &) const;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "vm.hpp"
+
+// M:N scheduler for the fiber instructions (spawn, yield, join, chan, send, recv).
+//
+// Fibers are plain Exec_contexts; each worker thread owns one VM and swaps fiber
+// contexts in and out of it. Workers keep a local run queue, run fibers in
+// bounded slices and steal from each other when their own queue is empty.
+// The run ends when the main fiber halts, a fiber traps or every fiber is blocked.
+class Scheduler final {
+private:
+    struct Fiber {
+        uint64_t id;
+        Exec_context ctx{};
+        bool done{};
+        f64 result{};                // Top of the stack at halt, handed to joiners
+        std::vector<Fiber *> joiners{};
+    };
+
+    struct Channel {
+        std::deque<f64> values{};
+        std::deque<Fiber *> receivers{};
+    };
+
+    struct Worker {
+        std::unique_ptr<VM> vm;
+        std::mutex queue_mutex{};
+        std::deque<Fiber *> queue{}; // Owner takes from the front, thieves from the back
+    };
+
+    const VM &m_prototype;
+    std::vector<std::unique_ptr<Worker>> m_workers{};
+
+    // Guards fiber creation, completion and channels, i.e. everything that can block or wake
+    std::mutex m_mutex{};
+    std::unordered_map<uint64_t, std::unique_ptr<Fiber>> m_fibers{};
+    std::vector<Channel> m_channels{};
+    uint64_t m_next_fiber_id{};
+
+    std::atomic<int64_t> m_active{}; // Fibers that are runnable or running
+    std::atomic<bool> m_done{};
+    std::atomic<uint64_t> m_steps{};
+    std::atomic<uint64_t> m_steps_left{}; // Budget shared by all fibers, claimed a slice at a time
+    bool m_out_of_steps{};                // Guarded by m_mutex
+
+    std::mutex m_idle_mutex{};
+    std::condition_variable m_idle_cv{};
+
+    Trap m_trap{Trap::TRAP_OK};
+    Fiber *m_trapped{};
+
+    void worker_loop(size_t);
+    Fiber *next_fiber(size_t);
+    void push(size_t, Fiber *);
+    void run_fiber(size_t, Fiber *);
+    bool handle_request(size_t, Fiber *, const Fiber_request &);
+    void finish(size_t, Fiber *);
+    void fail(Fiber *, Trap);
+    uint64_t claim_steps(uint64_t);
+    void out_of_steps();
+
+public:
+    static constexpr uint64_t SLICE_STEPS = 10000; // Instructions before a fiber is preempted
+
+    Scheduler(const VM &, unsigned workers);
+    ~Scheduler();
+
+    // Runs the VM's current context as fiber 0 until it halts, or until the fibers have
+    // executed max_steps instructions in total (RUN_YIELDED with YIELD_STEPS; unlike
+    // VM::vm_run the run cannot be resumed). On return the VM holds the main fiber's
+    // final context, or the context of the fiber that trapped.
+    Run_result run(VM &, uint64_t max_steps = UINT64_MAX);
+    void interrupt() noexcept; // Async-signal and thread safe
+
+    uint64_t get_trapped_fiber() const&;
+    uint64_t get_fiber_count() const&;
+};
+
+[[nodiscard]] bool program_uses_fibers(const VM &);
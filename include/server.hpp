@@ -0,0 +1,38 @@
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <string>
+
+// Long-lived execution daemon, `bm --serve <socket path>`.
+//
+// Clients talk to it over a Unix stream socket using length-prefixed frames in
+// host byte order. Requests may be pipelined: every request carries a client
+// chosen tag that is echoed in its response, and responses are sent as soon as
+// their job finishes, which may be out of order.
+//
+//   frame     := u32 payload_len, u8 type, payload
+//   LOAD      := u64 tag, source bytes
+//             -> u64 tag, u32 bm_status, u64 program_id, error message bytes
+//   EXEC      := u64 tag, u64 program_id, u64 step_budget, u32 n, f64 inputs[n]
+//             -> u64 tag, u32 bm_status, u32 bm_trap, u64 steps, u32 n, f64 stack[n]
+//   STATS     := u64 tag
+//             -> u64 tag, latency histogram text
+//
+// Responses use the request type with BM_FRAME_RESPONSE set. Program ids are
+// opaque and never reused; loading a source that is already cached returns its
+// id. The cache keeps the most recently used programs, and EXEC of an evicted
+// id fails with BM_ERR_INVALID_ARG until the source is loaded again. print_debug
+// output from programs is discarded.
+
+enum Frame_type : uint8_t {
+    BM_FRAME_LOAD = 1,
+    BM_FRAME_EXEC = 2,
+    BM_FRAME_STATS = 3,
+    BM_FRAME_RESPONSE = 0x80,
+};
+
+constexpr uint32_t BM_MAX_FRAME_SIZE = 64u << 20;
+
+// Serves requests until stop becomes non-zero. Returns false if the socket could not be set up.
+bool bm_serve(const std::string &socket_path, unsigned workers, const volatile std::sig_atomic_t &stop);
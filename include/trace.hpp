@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+enum class Inst_type;
+
+// One executed instruction as seen right before it ran
+struct Trace_entry {
+    int64_t ip;
+    Inst_type type;
+    double top; // Top of the stack, 0 when the stack was empty
+};
+
+// Fixed-size ring of the last N executed instructions.
+// Recording is a store and a masked increment: no allocation, no I/O.
+// N must be a power of two; N == 0 compiles the tracer out entirely.
+template <size_t N>
+class Trace_ring final {
+    static_assert((N & (N - 1)) == 0, "Trace_ring size must be a power of two");
+
+private:
+    std::array<Trace_entry, N> m_entries{};
+    uint64_t m_count{};
+
+public:
+    static constexpr bool enabled = true;
+
+    void record(const int64_t ip, const Inst_type type, const double top) noexcept {
+        m_entries[m_count & (N - 1)] = Trace_entry{ip, type, top};
+        ++m_count;
+    }
+
+    // Total number of recorded instructions, including overwritten ones
+    uint64_t count() const noexcept { return m_count; }
+
+    // Calls f(entry) for the retained entries, oldest first
+    template <typename F>
+    void for_each(F &&f) const {
+        const uint64_t kept = m_count < N ? m_count : N;
+        for (uint64_t i = m_count - kept; i < m_count; ++i) {
+            f(m_entries[i & (N - 1)]);
+        }
+    }
+
+    void clear() noexcept { m_count = 0; }
+};
+
+template <>
+class Trace_ring<0> final {
+public:
+    static constexpr bool enabled = false;
+
+    void record(int64_t, Inst_type, double) noexcept {}
+    uint64_t count() const noexcept { return 0; }
+    template <typename F>
+    void for_each(F &&) const {}
+    void clear() noexcept {}
+};
+
+#ifndef BM_TRACE_DEPTH
+#define BM_TRACE_DEPTH 0
+#endif
+
+using VM_trace = Trace_ring<BM_TRACE_DEPTH>;
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <memory>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 #include <string>
 #include <optional>
-#include <unordered_map>
+#include <ostream>
+#include "output.hpp"
+#include "trace.hpp"
 
 enum class Trap {
     TRAP_OK = 0,
@@ -15,10 +20,35 @@ enum class Trap {
     TRAP_ILLEGAL_INST,
     TRAP_DIV_BY_ZERO,
     TRAP_ILLEGAL_INST_ACCESS,
+    TRAP_BREAKPOINT,
+    TRAP_FIBER,     // A fiber instruction needs the scheduler, see VM::get_fiber_request
+    TRAP_DEADLOCK,  // Every fiber is blocked on a join or an empty channel
+    TRAP_ILLEGAL_MEMORY_ACCESS, // Heap access outside the allocated region
+    TRAP_OUT_OF_MEMORY,         // alloc past the heap limit
 };
 
 const std::string trap_as_str(Trap trap) noexcept;
 
+enum class Run_status {
+    RUN_HALTED = 0,
+    RUN_YIELDED,  // Step budget, time slice or interrupt; state is intact and vm_run can resume
+    RUN_TRAPPED,
+};
+
+enum class Yield_reason {
+    YIELD_NONE = 0,  // Halted or trapped
+    YIELD_STEPS,     // Step budget used up
+    YIELD_TIME,      // max_time elapsed
+    YIELD_INTERRUPT, // vm_interrupt
+};
+
+struct Run_result {
+    Run_status status;
+    Trap trap;
+    uint64_t steps;
+    Yield_reason reason{Yield_reason::YIELD_NONE}; // Why a RUN_YIELDED run stopped
+};
+
 enum class Inst_type {
     INST_NOP,
     INST_PUSH,
@@ -42,6 +72,28 @@ enum class Inst_type {
     INST_SHL,
     INST_SHR,
     INST_PRINT_DEBUG,
+    INST_BREAK, // Reserved for the debugger, patched over the instruction it replaces
+    INST_SPAWN,
+    INST_YIELD,
+    INST_JOIN,
+    INST_CHAN,
+    INST_SEND,
+    INST_RECV,
+    INST_NATIVE, // Call a host function by its index in the VM's native table
+    INST_ALLOC,
+    INST_LOAD_I64,
+    INST_LOAD_F64,
+    INST_LOAD_U8,
+    INST_STORE_I64,
+    INST_STORE_F64,
+    INST_STORE_U8,
+    INST_MEMCPY,
+    INST_MEMSET,
+    INST_MEMCMP,
+    INST_ENTER,       // enter ARGS LOCALS: open a frame over the top ARGS values plus LOCALS zeroed slots
+    INST_LOAD_LOCAL,
+    INST_STORE_LOCAL,
+    INST_TCALL,       // Tail call: drop the current frame and jump without saving a return address
 };
 
 using i64 = int64_t;
@@ -53,6 +105,48 @@ struct Instruction {
     Operand operand;
 };
 
+// Locals of one function invocation: stack[base, base + size) holds its arguments then its locals.
+// depth is the call stack size at `enter`, so ret only unwinds frames opened by the returning function.
+struct Frame {
+    size_t base;
+    size_t size;
+    size_t depth;
+};
+
+// Everything a green thread owns; swapped in and out of a VM by the fiber scheduler
+struct Exec_context {
+    std::vector<f64> stack{};
+    std::vector<i64> call_stack{};
+    i64 ip{};
+    int halt{};
+    std::vector<uint8_t> heap{};
+    std::vector<Frame> frames{};
+};
+
+// Operands of the last fiber instruction, already popped off the stack
+struct Fiber_request {
+    Inst_type type;
+    i64 target; // Spawn entry point, join fiber id or channel id
+    f64 value;  // Spawn argument or sent value
+};
+
+// Host function called by `native NAME`. args points at the `arity` values popped off
+// the stack (deepest first), results at room for `results` values that replace them.
+// Anything but TRAP_OK stops the VM with the stack left as it was before the call.
+using Native_fn = Trap (*)(const f64 *args, f64 *results, void *user);
+
+struct Native {
+    std::string name;
+    Native_fn fn;
+    uint32_t arity;
+    uint32_t results;
+    void *user;
+    std::shared_ptr<void> owner{}; // Keeps `user` alive for bindings that allocate it, may be null
+};
+
+// sqrt, sin, cos, tan, exp, log, pow, floor, ceil, abs, min, max; every VM starts with these
+const std::vector<Native> &builtin_natives();
+
 const std::string inst_as_str(const Inst_type &type) noexcept;
 
 [[nodiscard]] Instruction inst_nop() noexcept ;
@@ -69,6 +163,7 @@ const std::string inst_as_str(const Inst_type &type) noexcept;
 [[nodiscard]] Instruction inst_jmp(const std::string &) noexcept;
 [[nodiscard]] Instruction inst_jmp_if(const std::string&) noexcept;
 [[nodiscard]] Instruction inst_halt() noexcept;
+[[nodiscard]] Instruction inst_print_debug() noexcept;
 [[nodiscard]] Instruction inst_not() noexcept;
 [[nodiscard]] Instruction inst_ret() noexcept;
 [[nodiscard]] Instruction inst_call(const std::string &) noexcept;
@@ -77,29 +172,80 @@ const std::string inst_as_str(const Inst_type &type) noexcept;
 [[nodiscard]] Instruction inst_or() noexcept;
 [[nodiscard]] Instruction inst_shl(i64, i64) noexcept; // Shift index left by amount
 [[nodiscard]] Instruction inst_shr(i64, i64) noexcept; // Shift index right by amount
+[[nodiscard]] Instruction inst_break() noexcept;
+[[nodiscard]] Instruction inst_spawn(const std::string &) noexcept;
+[[nodiscard]] Instruction inst_yield() noexcept;
+[[nodiscard]] Instruction inst_join() noexcept;
+[[nodiscard]] Instruction inst_chan() noexcept;
+[[nodiscard]] Instruction inst_send() noexcept;
+[[nodiscard]] Instruction inst_recv() noexcept;
+[[nodiscard]] Instruction inst_native(i64) noexcept;
+[[nodiscard]] Instruction inst_alloc() noexcept;
+[[nodiscard]] Instruction inst_load_i64() noexcept;
+[[nodiscard]] Instruction inst_load_f64() noexcept;
+[[nodiscard]] Instruction inst_load_u8() noexcept;
+[[nodiscard]] Instruction inst_store_i64() noexcept;
+[[nodiscard]] Instruction inst_store_f64() noexcept;
+[[nodiscard]] Instruction inst_store_u8() noexcept;
+[[nodiscard]] Instruction inst_memcpy() noexcept;
+[[nodiscard]] Instruction inst_memset() noexcept;
+[[nodiscard]] Instruction inst_memcmp() noexcept;
+[[nodiscard]] Instruction inst_enter(i64, i64) noexcept; // Argument and local counts
+[[nodiscard]] Instruction inst_load_local(i64) noexcept;
+[[nodiscard]] Instruction inst_store_local(i64) noexcept;
+[[nodiscard]] Instruction inst_tcall(const std::string &) noexcept;
 
 class VM final {
 private:
     std::vector<f64> m_stack{};
     std::vector<Instruction> m_program{};
     i64 m_ip{}; // Instruction Pointer
-    std::string m_memory{};
+    std::string m_memory{}; // Assembly source text
+
+    // Linear memory for load/store. alloc bumps its size (8-byte aligned) and the vector's
+    // capacity doubles as the arena grows; addresses are byte offsets, so growth never moves them.
+    std::vector<uint8_t> m_heap{};
+    size_t m_heap_limit{DEFAULT_HEAP_LIMIT};
+
+    bool vm_heap_range(f64 addr, f64 len, size_t &offset) const; // Is [addr, addr + len) allocated?
     int m_halt{};
 
     std::optional<std::unordered_map<std::string, int>> m_labels{}; // Label name (string) and position in file (int)
     std::vector<i64> m_call_stack{};
+    std::vector<Frame> m_frames{};
+
+    bool vm_pop_frame(); // Slide whatever is above the current function's frame down over it
 
     std::optional<std::unordered_map<std::string, std::variant<int, double, std::string>>> m_macros{};
 
+    std::vector<Native> m_natives{builtin_natives()}; // Indexed by the operand of INST_NATIVE
+
+    std::string m_error{}; // Message for the last failed translate/load/save
+
+    bool vm_asm_error(const std::string &);
+
+    Fiber_request m_fiber_request{};
+    std::atomic<bool> m_interrupt{}; // Set from any thread to make vm_run yield
+    VM_trace m_trace{}; // Last BM_TRACE_DEPTH executed instructions, empty when tracing is compiled out
+
+    Output m_output{}; // print_debug and vm_dump_stack, flushed whenever vm_run returns
+
+    Run_result vm_run_loop(uint64_t max_steps, std::chrono::microseconds max_time);
+
+    friend class Reg_engine; // Runs translated blocks directly on m_stack
+
 public:
+    static constexpr size_t DEFAULT_HEAP_LIMIT = 64 * 1024 * 1024;
+
     VM ();
     explicit VM(const std::vector<Instruction> &);
 
     void set_stack(const std::vector<f64>&) &;
-    const std::vector<f64> get_stack() const&;
+    const std::vector<f64> &get_stack() const&;
 
     void set_program(const std::vector<Instruction>&) &;
     const std::vector<Instruction> get_program() const&;
+    size_t get_program_size() const&;
     
     void set_ip(i64) &;
     i64 get_ip() const&;
@@ -110,14 +256,52 @@ public:
     void set_halt(int) &;
     const int get_halt() const&;
 
+    const std::string &get_error() const&;
+
     i64 get_label_loc(const std::string &) &;
+    void set_labels(const std::unordered_map<std::string, int> &) &;
+    const std::optional<std::unordered_map<std::string, int>> &get_labels() const&;
+    const std::vector<i64> &get_call_stack() const&;
+    const std::vector<Frame> &get_frames() const&;
+
+    const Fiber_request &get_fiber_request() const&;
+
+    void set_heap_limit(size_t) &;
+    size_t get_heap_limit() const&;
+    void vm_reserve_heap(size_t); // Pre-size the arena so early allocs do not grow it
+    const std::vector<uint8_t> &get_heap() const&;
+
+    Output &get_output() &;
+    const Output &get_output() const&;
+    void vm_flush_output();
+
+    // Natives must be registered before assembling programs that call them; the assembler
+    // stores table indexes, so a VM running a program needs the table it was assembled with.
+    // Registering an existing name replaces it in place. Returns the native's index.
+    i64 vm_register_native(const Native &);
+    void set_natives(const std::vector<Native> &) &;
+    const std::vector<Native> &get_natives() const&;
+
+    const Instruction &vm_inst_at(i64) const;
+    void vm_patch_inst(i64, const Instruction &);
     
+    void vm_reset(i64); // Clear the stacks and halt flag and jump to the given entry point
     void vm_push_inst(const Instruction &);
+    void vm_push_value(f64);
     Trap vm_execute_inst(const Instruction &);
+    Trap vm_step(); // Fetch and execute the instruction at ip
+    // Run for at most max_steps instructions and max_time (zero: no time limit).
+    // The clock and interrupt flag are only checked on backward branches and calls.
+    Run_result vm_run(uint64_t max_steps, std::chrono::microseconds max_time = std::chrono::microseconds::zero());
+    void vm_interrupt() noexcept; // Async-signal and thread safe
+    void vm_clear_interrupt() noexcept; // Drop an interrupt that no run has consumed yet
+    void vm_swap_context(Exec_context &) noexcept;
     void vm_load_program_from_memory(const std::vector<Instruction> &);
-    void vm_load_program_from_file(const std::string &);
-    void vm_save_program_to_file(const std::string &);
-    void vm_translate_asm();
+    [[nodiscard]] bool vm_load_program_from_file(const std::string &);
+    [[nodiscard]] bool vm_save_program_to_file(const std::string &);
+    [[nodiscard]] bool vm_translate_asm(); // Also runs vm_optimize_tail_calls
+    size_t vm_optimize_tail_calls(); // Rewrite `call f; ret` into `tcall f; ret`, returns the count
     void vm_parse_labels(const std::vector<std::string> &);
-    void vm_dump_stack() const;
+    void vm_dump_stack(); // Through the VM's output, so it stays ordered after print_debug
+    void vm_dump_state(std::ostream &) const; // ip, recent trace, stack and call stack
 };
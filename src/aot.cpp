@@ -0,0 +1,463 @@
+#include "../include/aot.hpp"
+#include <cmath>
+#include <set>
+#include <sstream>
+#include <variant>
+
+namespace {
+
+std::string f64_literal(const f64 value) {
+    if (std::isnan(value)) {
+        return std::signbit(value) ? "-std::numeric_limits<f64>::quiet_NaN()" : "std::numeric_limits<f64>::quiet_NaN()";
+    }
+    if (std::isinf(value)) {
+        return value < 0 ? "-std::numeric_limits<f64>::infinity()" : "std::numeric_limits<f64>::infinity()";
+    }
+    std::ostringstream out;
+    out << std::hexfloat << value; // Exact, unlike any decimal rendering at a fixed precision
+    return out.str();
+}
+
+class Emitter {
+private:
+    const VM &m_vm;
+    std::vector<Instruction> m_program;
+    std::ostringstream m_out{};
+    std::string m_error{};
+    std::set<i64> m_targets{};      // Instructions that need a C++ label
+    std::set<i64> m_return_sites{};
+    bool m_frames{};
+
+    // Resolved label, or -1 when the interpreter would trap with TRAP_ILLEGAL_INST_ACCESS
+    i64 target(const Instruction &inst) const {
+        const auto &labels = m_vm.get_labels();
+        if (!labels.has_value()) {
+            return -1;
+        }
+        const auto it = labels->find(std::get<std::string>(inst.operand));
+        return it != labels->end() ? it->second : -1;
+    }
+
+    void stop(const char *trap, const i64 ip) {
+        m_out << "        return stop(Trap::" << trap << ", " << ip << ");\n";
+    }
+    void check(const std::string &cond, const char *trap, const i64 ip) {
+        m_out << "        if (" << cond << ") {\n    ";
+        stop(trap, ip);
+        m_out << "        }\n";
+    }
+    void jump(const i64 to) {
+        m_out << "        goto I" << to << ";\n";
+    }
+
+    bool scan();
+    bool emit_inst(i64);
+
+public:
+    explicit Emitter(const VM &vm) : m_vm(vm), m_program(vm.get_program()) {}
+
+    bool emit(std::ostream &);
+    const std::string &error() const { return m_error; }
+};
+
+bool Emitter::scan() {
+    const i64 size = static_cast<i64>(m_program.size());
+    if (const i64 entry = m_vm.get_ip(); entry > 0 && entry < size) {
+        m_targets.insert(entry);
+    }
+    for (i64 ip = 0; ip < size; ++ip) {
+        const Instruction &inst = m_program[ip];
+        switch (inst.type) {
+            case Inst_type::INST_JMP:
+            case Inst_type::INST_JMP_IF:
+            case Inst_type::INST_CALL:
+            case Inst_type::INST_TCALL:
+                if (std::holds_alternative<std::string>(inst.operand)) {
+                    if (const i64 to = target(inst); to >= 0) {
+                        m_targets.insert(std::min(to, size));
+                    }
+                }
+                if (inst.type == Inst_type::INST_CALL) {
+                    m_return_sites.insert(ip + 1);
+                    m_targets.insert(ip + 1);
+                }
+                break;
+            case Inst_type::INST_ENTER:
+            case Inst_type::INST_LOAD_LOCAL:
+            case Inst_type::INST_STORE_LOCAL:
+                m_frames = true;
+                break;
+            case Inst_type::INST_NATIVE: {
+                if (!std::holds_alternative<i64>(inst.operand)) {
+                    break; // Traps at run time like in the interpreter
+                }
+                const i64 index = std::get<i64>(inst.operand);
+                const auto &natives = m_vm.get_natives();
+                const auto &builtins = builtin_natives();
+                if (index >= 0 && static_cast<size_t>(index) < natives.size() &&
+                    (static_cast<size_t>(index) >= builtins.size() || natives[index].name != builtins[index].name)) {
+                    m_error = "Native '" + natives[index].name + "' at " + std::to_string(ip) +
+                              " is host-registered; emitted programs only have the built-ins.";
+                    return false;
+                }
+                break;
+            }
+            case Inst_type::INST_BREAK:
+            case Inst_type::INST_SPAWN:
+            case Inst_type::INST_YIELD:
+            case Inst_type::INST_JOIN:
+            case Inst_type::INST_CHAN:
+            case Inst_type::INST_SEND:
+            case Inst_type::INST_RECV:
+            case Inst_type::INST_ALLOC:
+            case Inst_type::INST_LOAD_I64:
+            case Inst_type::INST_LOAD_F64:
+            case Inst_type::INST_LOAD_U8:
+            case Inst_type::INST_STORE_I64:
+            case Inst_type::INST_STORE_F64:
+            case Inst_type::INST_STORE_U8:
+            case Inst_type::INST_MEMCPY:
+            case Inst_type::INST_MEMSET:
+            case Inst_type::INST_MEMCMP:
+                m_error = "Instruction " + inst_as_str(inst.type) + " at " + std::to_string(ip) +
+                          " is not supported by --emit-cpp.";
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+bool Emitter::emit_inst(const i64 ip) {
+    const Instruction &inst = m_program[ip];
+    const bool has_i64 = std::holds_alternative<i64>(inst.operand);
+    const bool has_label = std::holds_alternative<std::string>(inst.operand);
+    const bool has_pair = std::holds_alternative<std::pair<i64, i64>>(inst.operand);
+
+    switch (inst.type) {
+        case Inst_type::INST_NOP:
+            break;
+
+        case Inst_type::INST_PUSH:
+            if (!has_i64 && !std::holds_alternative<f64>(inst.operand)) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            check("sp == BM_AOT_STACK_SIZE", "TRAP_STACK_OVERFLOW", ip);
+            m_out << "        stack[sp++] = "
+                  << f64_literal(has_i64 ? static_cast<f64>(std::get<i64>(inst.operand)) : std::get<f64>(inst.operand))
+                  << ";\n";
+            break;
+
+        case Inst_type::INST_DUP: {
+            if (!has_i64) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const i64 n = std::get<i64>(inst.operand);
+            if (n < 0) {
+                stop("TRAP_STACK_UNDERFLOW", ip); // Interpreter compares as size_t
+                break;
+            }
+            check("sp <= " + std::to_string(n), "TRAP_STACK_UNDERFLOW", ip);
+            check("sp == BM_AOT_STACK_SIZE", "TRAP_STACK_OVERFLOW", ip);
+            m_out << "        stack[sp] = stack[sp - " << n + 1 << "];\n";
+            m_out << "        ++sp;\n";
+            break;
+        }
+
+        case Inst_type::INST_DROP:
+            check("sp == 0", "TRAP_STACK_UNDERFLOW", ip);
+            m_out << "        --sp;\n";
+            break;
+
+        case Inst_type::INST_SWAP: {
+            if (!has_i64 || std::get<i64>(inst.operand) < 0) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const i64 n = std::get<i64>(inst.operand);
+            check("sp < 2 || sp <= " + std::to_string(n), "TRAP_STACK_UNDERFLOW", ip);
+            m_out << "        std::swap(stack[sp - 1], stack[sp - " << n + 1 << "]);\n";
+            break;
+        }
+
+        case Inst_type::INST_PLUS:
+        case Inst_type::INST_MINUS:
+        case Inst_type::INST_MULT:
+        case Inst_type::INST_DIV: {
+            check("sp < 2", "TRAP_STACK_UNDERFLOW", ip);
+            if (inst.type == Inst_type::INST_DIV) {
+                check("stack[sp - 1] == 0", "TRAP_DIV_BY_ZERO", ip);
+            }
+            const char *op = inst.type == Inst_type::INST_PLUS    ? "+="
+                             : inst.type == Inst_type::INST_MINUS ? "-="
+                             : inst.type == Inst_type::INST_MULT  ? "*="
+                                                                  : "/=";
+            m_out << "        stack[sp - 2] " << op << " stack[sp - 1];\n";
+            m_out << "        --sp;\n";
+            break;
+        }
+
+        case Inst_type::INST_EQ:
+            check("sp < 2", "TRAP_STACK_UNDERFLOW", ip);
+            m_out << "        stack[sp - 2] = stack[sp - 1] == stack[sp - 2];\n";
+            m_out << "        --sp;\n";
+            break;
+
+        case Inst_type::INST_NOT:
+            check("sp == 0", "TRAP_STACK_UNDERFLOW", ip);
+            m_out << "        stack[sp - 1] = !stack[sp - 1];\n";
+            break;
+
+        case Inst_type::INST_XOR:
+        case Inst_type::INST_AND:
+        case Inst_type::INST_OR: {
+            const char op = inst.type == Inst_type::INST_XOR ? '^' : inst.type == Inst_type::INST_AND ? '&' : '|';
+            check("sp < 2", "TRAP_STACK_UNDERFLOW", ip);
+            m_out << "        stack[sp - 2] = static_cast<f64>(static_cast<i64>(stack[sp - 1]) " << op
+                  << " static_cast<i64>(stack[sp - 2]));\n";
+            m_out << "        --sp;\n";
+            break;
+        }
+
+        case Inst_type::INST_SHL:
+        case Inst_type::INST_SHR: {
+            check("sp == 0", "TRAP_STACK_UNDERFLOW", ip);
+            if (!has_pair) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const auto [index, amount] = std::get<std::pair<i64, i64>>(inst.operand);
+            if (index < 0) {
+                stop("TRAP_ILLEGAL_INST_ACCESS", ip);
+                break;
+            }
+            check("sp <= " + std::to_string(index), "TRAP_ILLEGAL_INST_ACCESS", ip);
+            m_out << "        f64 &value = stack[sp - " << index + 1 << "];\n";
+            check("static_cast<f64>(static_cast<i64>(value)) != value", "TRAP_ILLEGAL_INST", ip);
+            m_out << "        value = static_cast<f64>(static_cast<i64>(value) "
+                  << (inst.type == Inst_type::INST_SHL ? "<<" : ">>") << ' ' << amount << ");\n";
+            break;
+        }
+
+        case Inst_type::INST_JMP:
+        case Inst_type::INST_JMP_IF:
+        case Inst_type::INST_CALL:
+        case Inst_type::INST_TCALL: {
+            if (!has_label) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const i64 to = std::min(target(inst), static_cast<i64>(m_program.size()));
+            if (inst.type == Inst_type::INST_JMP_IF) {
+                check("sp == 0", "TRAP_STACK_UNDERFLOW", ip);
+                m_out << "        if (static_cast<i64>(stack[--sp]) != 0) {\n    ";
+                if (to < 0) {
+                    stop("TRAP_ILLEGAL_INST_ACCESS", ip);
+                } else {
+                    jump(to);
+                }
+                m_out << "        }\n";
+                break;
+            }
+            if (to < 0) {
+                stop("TRAP_ILLEGAL_INST_ACCESS", ip);
+                break;
+            }
+            if (inst.type == Inst_type::INST_CALL) {
+                check("csp == BM_AOT_CALL_DEPTH", "TRAP_STACK_OVERFLOW", ip);
+                m_out << "        calls[csp++] = " << ip + 1 << ";\n";
+            } else if (inst.type == Inst_type::INST_TCALL && m_frames) {
+                check("!pop_frame()", "TRAP_STACK_UNDERFLOW", ip);
+            }
+            jump(to);
+            break;
+        }
+
+        case Inst_type::INST_RET:
+            check("csp == 0", "TRAP_STACK_UNDERFLOW", ip);
+            if (m_frames) {
+                check("!pop_frame()", "TRAP_STACK_UNDERFLOW", ip);
+            }
+            m_out << "        switch (calls[--csp]) {\n";
+            for (const i64 site : m_return_sites) {
+                m_out << "            case " << site << ": goto I" << site << ";\n";
+            }
+            m_out << "            default: break; // Only call pushes return addresses\n";
+            m_out << "        }\n";
+            m_out << "        return stop(Trap::TRAP_ILLEGAL_INST_ACCESS, calls[csp]);\n";
+            break;
+
+        case Inst_type::INST_HALT:
+            stop("TRAP_OK", ip);
+            break;
+
+        case Inst_type::INST_PRINT_DEBUG:
+            check("sp == 0", "TRAP_STACK_UNDERFLOW", ip);
+            m_out << "        rt.output.write_value(stack[--sp]);\n";
+            break;
+
+        case Inst_type::INST_NATIVE: {
+            const i64 index = has_i64 ? std::get<i64>(inst.operand) : -1;
+            if (index < 0 || static_cast<size_t>(index) >= m_vm.get_natives().size()) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const Native &native = m_vm.get_natives()[index];
+            m_out << "        const Native &native = rt.natives[" << index << "]; // " << native.name << '\n';
+            check("sp < " + std::to_string(native.arity), "TRAP_STACK_UNDERFLOW", ip);
+            check("sp + " + std::to_string(native.results) + " > BM_AOT_STACK_SIZE", "TRAP_STACK_OVERFLOW", ip);
+            m_out << "        f64 *args = stack + sp - " << native.arity << ";\n";
+            m_out << "        if (const Trap trap = native.fn(args, args + " << native.arity
+                  << ", native.user); trap != Trap::TRAP_OK) {\n";
+            m_out << "            return stop(trap, " << ip << ");\n";
+            m_out << "        }\n";
+            m_out << "        std::copy(args + " << native.arity << ", args + " << native.arity + native.results
+                  << ", args);\n";
+            m_out << "        sp = sp - " << native.arity << " + " << native.results << ";\n";
+            break;
+        }
+
+        case Inst_type::INST_ENTER: {
+            if (!has_pair) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const auto [args, locals] = std::get<std::pair<i64, i64>>(inst.operand);
+            if (args < 0 || locals < 0) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            check("sp < " + std::to_string(args), "TRAP_STACK_UNDERFLOW", ip);
+            check("sp + " + std::to_string(locals) + " > BM_AOT_STACK_SIZE || fsp == BM_AOT_CALL_DEPTH",
+                  "TRAP_STACK_OVERFLOW", ip);
+            m_out << "        frames[fsp++] = Frame{sp - " << args << ", " << args + locals << ", csp};\n";
+            if (locals > 0) {
+                m_out << "        std::fill(stack + sp, stack + sp + " << locals << ", 0.0);\n";
+                m_out << "        sp += " << locals << ";\n";
+            }
+            break;
+        }
+
+        case Inst_type::INST_LOAD_LOCAL:
+        case Inst_type::INST_STORE_LOCAL: {
+            if (!has_i64) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            const i64 index = std::get<i64>(inst.operand);
+            if (index < 0) {
+                stop("TRAP_ILLEGAL_INST", ip);
+                break;
+            }
+            check("fsp == 0 || frames[fsp - 1].depth != csp || frames[fsp - 1].size <= " + std::to_string(index),
+                  "TRAP_ILLEGAL_INST", ip);
+            m_out << "        const size_t slot = frames[fsp - 1].base + " << index << ";\n";
+            if (inst.type == Inst_type::INST_LOAD_LOCAL) {
+                check("slot >= sp", "TRAP_STACK_UNDERFLOW", ip);
+                check("sp == BM_AOT_STACK_SIZE", "TRAP_STACK_OVERFLOW", ip);
+                m_out << "        stack[sp] = stack[slot];\n";
+                m_out << "        ++sp;\n";
+            } else {
+                check("slot + 1 >= sp", "TRAP_STACK_UNDERFLOW", ip);
+                m_out << "        stack[slot] = stack[--sp];\n";
+            }
+            break;
+        }
+
+        default:
+            m_error = "Instruction " + inst_as_str(inst.type) + " at " + std::to_string(ip) +
+                      " is not supported by --emit-cpp.";
+            return false;
+    }
+    return true;
+}
+
+bool Emitter::emit(std::ostream &out) {
+    if (!scan()) {
+        return false;
+    }
+    const i64 size = static_cast<i64>(m_program.size());
+
+    m_out << "// Generated by bm --emit-cpp. Build with:\n"
+          << "//     c++ -std=c++17 -O3 -I<bm>/include this.cpp -lbm -lpthread\n"
+          << "#include <algorithm>\n"
+          << "#include <limits>\n"
+          << "#include \"aot_runtime.hpp\"\n\n"
+          << "namespace {\n\n"
+          << "void run(Aot_runtime &rt, Aot_result &result) {\n"
+          << "    f64 stack[BM_AOT_STACK_SIZE];\n"
+          << "    size_t sp = 0;\n"
+          << "    i64 calls[BM_AOT_CALL_DEPTH];\n"
+          << "    size_t csp = 0;\n";
+    if (m_frames) {
+        m_out << "    Frame frames[BM_AOT_CALL_DEPTH];\n"
+              << "    size_t fsp = 0;\n";
+    }
+    m_out << "    (void)rt;\n\n"
+          << "    const auto stop = [&](const Trap trap, const i64 ip) {\n"
+          << "        result.trap = trap;\n"
+          << "        result.ip = ip;\n"
+          << "        result.stack.assign(stack, stack + sp);\n"
+          << "        result.call_stack.assign(calls, calls + csp);\n"
+          << "    };\n";
+    if (m_frames) {
+        // Same as VM::vm_pop_frame
+        m_out << "    const auto pop_frame = [&]() {\n"
+              << "        if (fsp == 0 || frames[fsp - 1].depth != csp) {\n"
+              << "            return true;\n"
+              << "        }\n"
+              << "        const Frame &frame = frames[fsp - 1];\n"
+              << "        if (sp < frame.base + frame.size) {\n"
+              << "            return false;\n"
+              << "        }\n"
+              << "        std::copy(stack + frame.base + frame.size, stack + sp, stack + frame.base);\n"
+              << "        sp -= frame.size;\n"
+              << "        --fsp;\n"
+              << "        return true;\n"
+              << "    };\n";
+    }
+    m_out << '\n';
+
+    // Start where the VM would, i.e. at the "start" label when there is one
+    if (const i64 entry = m_vm.get_ip(); entry < 0 || entry >= size) {
+        m_out << "    return stop(Trap::TRAP_ILLEGAL_INST_ACCESS, " << entry << ");\n";
+    } else if (entry != 0) {
+        m_out << "    goto I" << entry << ";\n";
+    }
+
+    for (i64 ip = 0; ip < size; ++ip) {
+        const Instruction &inst = m_program[ip];
+        if (m_targets.count(ip) != 0) {
+            m_out << "I" << ip << ":\n";
+        }
+        m_out << "    { // " << ip << ": " << inst_as_str(inst.type) << '\n';
+        if (!emit_inst(ip)) {
+            return false;
+        }
+        m_out << "    }\n";
+    }
+    if (m_targets.count(size) != 0) {
+        m_out << "I" << size << ":\n";
+    }
+    m_out << "    return stop(Trap::TRAP_ILLEGAL_INST_ACCESS, " << size << "); // Ran off the end\n"
+          << "}\n\n"
+          << "} // namespace\n\n"
+          << "int main(int argc, char *argv[]) { return aot_main(argc, argv, run); }\n";
+
+    out << m_out.str();
+    return true;
+}
+
+} // namespace
+
+bool aot_emit_cpp(const VM &vm, std::ostream &out, std::string &error) {
+    Emitter emitter(vm);
+    if (!emitter.emit(out)) {
+        error = emitter.error();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,187 @@
+#include "../include/aot.hpp"
+#include "../include/aot_runtime.hpp"
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Set by CMake for the bm target
+#ifndef BM_AOT_CXX
+#define BM_AOT_CXX "c++"
+#endif
+#ifndef BM_AOT_INCLUDE_DIR
+#define BM_AOT_INCLUDE_DIR "include"
+#endif
+#ifndef BM_AOT_LIBRARY
+#define BM_AOT_LIBRARY "-lbm"
+#endif
+
+namespace {
+
+std::string read_all(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+std::string read_all(std::FILE *file) {
+    std::string contents;
+    std::rewind(file);
+    char chunk[4096];
+    size_t n = 0;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        contents.append(chunk, n);
+    }
+    return contents;
+}
+
+// Runs argv[0] (searched in PATH) with stdout and stderr redirected to files, without a
+// shell, and returns its exit status or -1 if it could not be started or did not exit
+int run_program(const std::vector<std::string> &args, const std::string &out_path, const std::string &err_path) {
+    std::vector<char *> argv;
+    for (const std::string &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (err_path == out_path) {
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, err_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    }
+    pid_t pid{};
+    const int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        return -1;
+    }
+
+    int status{};
+    while (::waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+} // namespace
+
+bool aot_check(const VM &vm, const uint64_t max_steps, std::ostream &log) {
+    // Reference run, with print_debug captured
+    VM ref{vm.get_program()};
+    if (const auto &labels = vm.get_labels(); labels.has_value()) {
+        ref.set_labels(*labels);
+    }
+    ref.set_natives(vm.get_natives());
+    ref.set_ip(vm.get_ip());
+    std::FILE *captured = std::tmpfile();
+    if (captured == nullptr) {
+        log << "Could not create a temporary file.\n";
+        return false;
+    }
+    ref.get_output().set_file(captured);
+    const Run_result run = ref.vm_run(max_steps);
+    const std::string expected_output = read_all(captured);
+    std::fclose(captured);
+    if (run.status == Run_status::RUN_YIELDED) {
+        log << "The interpreter did not finish within " << max_steps << " steps; raise --steps.\n";
+        return false;
+    }
+    Aot_result expected{run.trap, ref.get_ip(), ref.get_stack(), ref.get_call_stack()};
+    std::ostringstream expected_result;
+    aot_write_result(expected_result, expected);
+
+    // Private 0700 directory with an unpredictable name, so nobody else can swap the files in it
+    std::string dir_template = (std::filesystem::temp_directory_path() / "bm-aot-XXXXXX").string();
+    if (::mkdtemp(dir_template.data()) == nullptr) {
+        log << "Could not create a temporary directory: " << std::strerror(errno) << '\n';
+        return false;
+    }
+    const std::filesystem::path dir = dir_template;
+    const auto cleanup = [&dir]() {
+        std::error_code ignored;
+        std::filesystem::remove_all(dir, ignored);
+    };
+
+    std::string error;
+    {
+        std::ofstream source(dir / "prog.cpp");
+        if (!aot_emit_cpp(vm, source, error)) {
+            log << "Error: " << error << '\n';
+            cleanup();
+            return false;
+        }
+    }
+
+    const std::vector<std::string> compile = {
+        BM_AOT_CXX,
+        "-std=c++17",
+        "-O3",
+        "-DBM_TRACE_DEPTH=" + std::to_string(BM_TRACE_DEPTH),
+        std::string("-I") + BM_AOT_INCLUDE_DIR,
+        (dir / "prog.cpp").string(),
+        BM_AOT_LIBRARY,
+        "-Wl,-rpath," + std::filesystem::path(BM_AOT_LIBRARY).parent_path().string(),
+        "-lpthread",
+        "-o",
+        (dir / "prog").string(),
+    };
+    const std::string compile_log = (dir / "compile.log").string();
+    if (run_program(compile, compile_log, compile_log) != 0) {
+        log << "Compiling the emitted C++ failed:\n" << read_all(dir / "compile.log");
+        cleanup();
+        return false;
+    }
+    // Exits non-zero on a trap, which is compared below
+    (void)run_program({(dir / "prog").string(), "--result", (dir / "result").string()}, (dir / "output").string(),
+                      "/dev/null");
+
+    // The program also prints its final stack on halt, which the reference run does not
+    std::string output = read_all(dir / "output");
+    if (run.trap == Trap::TRAP_OK) {
+        std::ostringstream dump;
+        dump << "Stack:\n";
+        if (expected.stack.empty()) {
+            dump << "[empty]\n";
+        }
+        for (const f64 value : expected.stack) {
+            dump << "  " << value << '\n';
+        }
+        const std::string tail = dump.str();
+        if (output.size() >= tail.size() && output.compare(output.size() - tail.size(), tail.size(), tail) == 0) {
+            output.resize(output.size() - tail.size());
+        }
+    }
+    const std::string actual_result = read_all(dir / "result");
+    cleanup();
+
+    bool ok = true;
+    if (output != expected_output) {
+        log << "Printed output differs:\n--- interpreter\n" << expected_output << "--- native\n" << output;
+        ok = false;
+    }
+    if (actual_result != expected_result.str()) {
+        log << "Final state differs:\n--- interpreter\n" << expected_result.str() << "--- native\n" << actual_result;
+        ok = false;
+    }
+    if (ok) {
+        log << "Native and interpreted runs match (" << trap_as_str(run.trap) << " after " << run.steps << " steps).\n";
+    }
+    return ok;
+}
@@ -0,0 +1,71 @@
+#include "../include/aot_runtime.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+void aot_write_result(std::ostream &out, const Aot_result &result) {
+    out << "trap " << static_cast<int>(result.trap) << '\n';
+    out << "ip " << result.ip << '\n';
+    out << "stack " << result.stack.size() << '\n' << std::hexfloat;
+    for (const f64 value : result.stack) {
+        out << value << '\n';
+    }
+    out << std::defaultfloat << "calls " << result.call_stack.size() << '\n';
+    for (const i64 ip : result.call_stack) {
+        out << ip << '\n';
+    }
+}
+
+int aot_main(const int argc, char *argv[], const Aot_program program) {
+    const char *result_path = nullptr;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::strcmp(argv[i], "--result") == 0) {
+            result_path = argv[i + 1];
+        }
+    }
+
+    Aot_runtime runtime{};
+    Aot_result result{};
+    program(runtime, result);
+    runtime.output.flush();
+
+    if (result_path != nullptr) {
+        std::ofstream file(result_path);
+        aot_write_result(file, result);
+    }
+
+    if (result.trap != Trap::TRAP_OK) {
+        std::cerr << "ERROR: " << trap_as_str(result.trap) << '\n';
+        std::cerr << "ip: " << result.ip << '\n';
+        std::cerr << "Stack:\n";
+        if (result.stack.empty()) {
+            std::cerr << "  [empty]\n";
+        }
+        for (const f64 value : result.stack) {
+            std::cerr << "  " << value << '\n';
+        }
+        std::cerr << "Call stack:\n";
+        if (result.call_stack.empty()) {
+            std::cerr << "  [empty]\n";
+        }
+        for (size_t i = result.call_stack.size(); i-- > 0;) {
+            std::cerr << "  " << result.call_stack[i] << '\n';
+        }
+        return EXIT_FAILURE;
+    }
+
+    // Same text as VM::vm_dump_stack
+    Output &out = runtime.output;
+    out.write("Stack:\n");
+    if (result.stack.empty()) {
+        out.write("[empty]\n");
+    }
+    for (const f64 value : result.stack) {
+        out.write("  ");
+        out.write_number(value);
+        out.write("\n");
+    }
+    out.flush();
+    return EXIT_SUCCESS;
+}
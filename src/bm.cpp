@@ -0,0 +1,407 @@
+#include "../include/bm.h"
+#include "../include/vm.hpp"
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static_assert(static_cast<int>(Trap::TRAP_OK) == BM_TRAP_OK);
+static_assert(static_cast<int>(Trap::TRAP_STACK_OVERFLOW) == BM_TRAP_STACK_OVERFLOW);
+static_assert(static_cast<int>(Trap::TRAP_STACK_UNDERFLOW) == BM_TRAP_STACK_UNDERFLOW);
+static_assert(static_cast<int>(Trap::TRAP_ILLEGAL_INST) == BM_TRAP_ILLEGAL_INST);
+static_assert(static_cast<int>(Trap::TRAP_DIV_BY_ZERO) == BM_TRAP_DIV_BY_ZERO);
+static_assert(static_cast<int>(Trap::TRAP_ILLEGAL_INST_ACCESS) == BM_TRAP_ILLEGAL_INST_ACCESS);
+static_assert(static_cast<int>(Trap::TRAP_BREAKPOINT) == BM_TRAP_BREAKPOINT);
+static_assert(static_cast<int>(Trap::TRAP_FIBER) == BM_TRAP_FIBER);
+static_assert(static_cast<int>(Trap::TRAP_DEADLOCK) == BM_TRAP_DEADLOCK);
+static_assert(static_cast<int>(Trap::TRAP_ILLEGAL_MEMORY_ACCESS) == BM_TRAP_ILLEGAL_MEMORY_ACCESS);
+static_assert(static_cast<int>(Trap::TRAP_OUT_OF_MEMORY) == BM_TRAP_OUT_OF_MEMORY);
+
+struct bm_program {
+    std::vector<Instruction> insts;
+    std::unordered_map<std::string, int> labels;
+    std::vector<Native> natives;
+    i64 entry;
+};
+
+struct bm_natives {
+    std::vector<Native> table;
+};
+
+struct bm_context {
+    const bm_program *program;
+    VM vm;
+    Trap trap;
+};
+
+namespace {
+
+void write_error(const std::string &message, char *err, const size_t err_len) {
+    if (err == nullptr || err_len == 0) {
+        return;
+    }
+    const size_t n = message.size() < err_len - 1 ? message.size() : err_len - 1;
+    std::memcpy(err, message.data(), n);
+    err[n] = '\0';
+}
+
+bm_status make_program(const VM &vm, bm_program **out) {
+    auto *program = new (std::nothrow) bm_program{};
+    if (program == nullptr) {
+        return BM_ERR_OUT_OF_MEMORY;
+    }
+    program->insts = vm.get_program();
+    program->natives = vm.get_natives();
+    if (const auto &labels = vm.get_labels(); labels.has_value()) {
+        program->labels = *labels;
+    }
+    const auto start = program->labels.find("start");
+    program->entry = start != program->labels.end() ? start->second : 0;
+    *out = program;
+    return BM_OK;
+}
+
+// Adapts a C callback to Native_fn; owned by the Native entry through `owner`
+struct C_native {
+    bm_native_fn fn;
+    void *user;
+};
+
+// Control-flow traps (breakpoint, fiber, deadlock) and unknown values must not reach
+// the debugger or scheduler from a host function, they become TRAP_ILLEGAL_INST
+Trap call_c_native(const f64 *args, f64 *results, void *user) {
+    const auto *native = static_cast<const C_native *>(user);
+    switch (native->fn(args, results, native->user)) {
+        case BM_TRAP_OK:
+            return Trap::TRAP_OK;
+        case BM_TRAP_STACK_OVERFLOW:
+            return Trap::TRAP_STACK_OVERFLOW;
+        case BM_TRAP_STACK_UNDERFLOW:
+            return Trap::TRAP_STACK_UNDERFLOW;
+        case BM_TRAP_DIV_BY_ZERO:
+            return Trap::TRAP_DIV_BY_ZERO;
+        case BM_TRAP_ILLEGAL_INST_ACCESS:
+            return Trap::TRAP_ILLEGAL_INST_ACCESS;
+        case BM_TRAP_ILLEGAL_MEMORY_ACCESS:
+            return Trap::TRAP_ILLEGAL_MEMORY_ACCESS;
+        case BM_TRAP_OUT_OF_MEMORY:
+            return Trap::TRAP_OUT_OF_MEMORY;
+        default:
+            return Trap::TRAP_ILLEGAL_INST;
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+const char *bm_status_str(const bm_status status) {
+    switch (status) {
+        case BM_OK:
+            return "BM_OK";
+        case BM_ERR_INVALID_ARG:
+            return "BM_ERR_INVALID_ARG";
+        case BM_ERR_ASSEMBLY:
+            return "BM_ERR_ASSEMBLY";
+        case BM_ERR_IO:
+            return "BM_ERR_IO";
+        case BM_ERR_OUT_OF_MEMORY:
+            return "BM_ERR_OUT_OF_MEMORY";
+        case BM_ERR_RANGE:
+            return "BM_ERR_RANGE";
+        case BM_ERR_INTERNAL:
+            return "BM_ERR_INTERNAL";
+        case BM_STEP_LIMIT:
+            return "BM_STEP_LIMIT";
+        case BM_TRAPPED:
+            return "BM_TRAPPED";
+        case BM_YIELDED:
+            return "BM_YIELDED";
+    }
+    return "BM_UNKNOWN_STATUS";
+}
+
+const char *bm_trap_str(const bm_trap trap) {
+    switch (trap) {
+        case BM_TRAP_OK:
+            return "TRAP_OK";
+        case BM_TRAP_STACK_OVERFLOW:
+            return "TRAP_STACK_OVERFLOW";
+        case BM_TRAP_STACK_UNDERFLOW:
+            return "TRAP_STACK_UNDERFLOW";
+        case BM_TRAP_ILLEGAL_INST:
+            return "TRAP_ILLEGAL_INST";
+        case BM_TRAP_DIV_BY_ZERO:
+            return "TRAP_DIV_BY_ZERO";
+        case BM_TRAP_ILLEGAL_INST_ACCESS:
+            return "TRAP_ILLEGAL_INST_ACCESS";
+        case BM_TRAP_BREAKPOINT:
+            return "TRAP_BREAKPOINT";
+        case BM_TRAP_FIBER:
+            return "TRAP_FIBER";
+        case BM_TRAP_DEADLOCK:
+            return "TRAP_DEADLOCK";
+        case BM_TRAP_ILLEGAL_MEMORY_ACCESS:
+            return "TRAP_ILLEGAL_MEMORY_ACCESS";
+        case BM_TRAP_OUT_OF_MEMORY:
+            return "TRAP_OUT_OF_MEMORY";
+    }
+    return "TRAP_UNKNOWN";
+}
+
+bm_status bm_program_assemble(const char *src, const size_t src_len, bm_program **out, char *err, const size_t err_len) {
+    return bm_program_assemble_with(nullptr, src, src_len, out, err, err_len);
+}
+
+bm_status bm_program_load(const char *path, bm_program **out, char *err, const size_t err_len) {
+    return bm_program_load_with(nullptr, path, out, err, err_len);
+}
+
+bm_status bm_natives_create(bm_natives **out) {
+    if (out == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        *out = new bm_natives{builtin_natives()};
+        return BM_OK;
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    }
+}
+
+void bm_natives_free(bm_natives *natives) {
+    delete natives;
+}
+
+bm_status bm_register_native(bm_natives *natives, const char *name, const bm_native_fn fn, const uint32_t arity,
+                             const uint32_t results, void *user) {
+    if (natives == nullptr || name == nullptr || *name == '\0' || fn == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        auto adapter = std::make_shared<C_native>(C_native{fn, user});
+        Native native{name, call_c_native, arity, results, adapter.get(), adapter};
+        for (auto &existing : natives->table) {
+            if (existing.name == native.name) {
+                existing = std::move(native);
+                return BM_OK;
+            }
+        }
+        natives->table.emplace_back(std::move(native));
+        return BM_OK;
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    }
+}
+
+bm_status bm_program_assemble_with(const bm_natives *natives, const char *src, const size_t src_len,
+                                   bm_program **out, char *err, const size_t err_len) {
+    if (src == nullptr || out == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        VM vm{};
+        if (natives != nullptr) {
+            vm.set_natives(natives->table);
+        }
+        vm.set_memory(std::string(src, src_len));
+        if (!vm.vm_translate_asm()) {
+            write_error(vm.get_error(), err, err_len);
+            return BM_ERR_ASSEMBLY;
+        }
+        return make_program(vm, out);
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    } catch (...) {
+        return BM_ERR_INTERNAL;
+    }
+}
+
+bm_status bm_program_load_with(const bm_natives *natives, const char *path, bm_program **out, char *err,
+                               const size_t err_len) {
+    if (path == nullptr || out == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        VM vm{};
+        if (natives != nullptr) {
+            vm.set_natives(natives->table);
+        }
+        if (!vm.vm_load_program_from_file(path)) {
+            write_error(vm.get_error(), err, err_len);
+            return BM_ERR_IO;
+        }
+        return make_program(vm, out);
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    } catch (...) {
+        return BM_ERR_INTERNAL;
+    }
+}
+
+bm_status bm_program_save(const bm_program *program, const char *path, char *err, const size_t err_len) {
+    if (program == nullptr || path == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        VM vm{program->insts};
+        vm.set_labels(program->labels);
+        if (!vm.vm_save_program_to_file(path)) {
+            write_error(vm.get_error(), err, err_len);
+            return BM_ERR_IO;
+        }
+        return BM_OK;
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    } catch (...) {
+        return BM_ERR_INTERNAL;
+    }
+}
+
+void bm_program_free(bm_program *program) {
+    delete program;
+}
+
+bm_status bm_context_create(const bm_program *program, bm_context **out) {
+    if (program == nullptr || out == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        auto *ctx = new bm_context{program, VM{program->insts}, Trap::TRAP_OK};
+        ctx->vm.set_labels(program->labels);
+        ctx->vm.set_natives(program->natives);
+        ctx->vm.vm_reset(program->entry);
+        *out = ctx;
+        return BM_OK;
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    } catch (...) {
+        return BM_ERR_INTERNAL;
+    }
+}
+
+void bm_context_free(bm_context *ctx) {
+    delete ctx;
+}
+
+bm_status bm_context_reset(bm_context *ctx) {
+    if (ctx == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    ctx->vm.vm_reset(ctx->program->entry);
+    ctx->trap = Trap::TRAP_OK;
+    return BM_OK;
+}
+
+bm_status bm_push(bm_context *ctx, const double value) {
+    if (ctx == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    try {
+        ctx->vm.vm_push_value(value);
+        return BM_OK;
+    } catch (const std::bad_alloc &) {
+        return BM_ERR_OUT_OF_MEMORY;
+    }
+}
+
+bm_status bm_run(bm_context *ctx, const uint64_t max_steps, uint64_t *steps) {
+    return bm_run_slice(ctx, max_steps, 0, steps);
+}
+
+bm_status bm_run_slice(bm_context *ctx, const uint64_t max_steps, const uint64_t max_micros, uint64_t *steps) {
+    if (ctx == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    Run_result result{Run_status::RUN_HALTED, Trap::TRAP_OK, 0};
+    bm_status status = BM_OK;
+    try {
+        result = ctx->vm.vm_run(max_steps, std::chrono::microseconds(max_micros));
+        switch (result.status) {
+            case Run_status::RUN_HALTED:
+                status = BM_OK;
+                break;
+            case Run_status::RUN_YIELDED:
+                status = result.reason == Yield_reason::YIELD_STEPS ? BM_STEP_LIMIT : BM_YIELDED;
+                break;
+            case Run_status::RUN_TRAPPED:
+                ctx->trap = result.trap;
+                status = BM_TRAPPED;
+                break;
+        }
+    } catch (const std::bad_alloc &) {
+        status = BM_ERR_OUT_OF_MEMORY;
+    } catch (...) {
+        status = BM_ERR_INTERNAL;
+    }
+    if (steps != nullptr) {
+        *steps = result.steps;
+    }
+    return status;
+}
+
+void bm_interrupt(bm_context *ctx) {
+    if (ctx != nullptr) {
+        ctx->vm.vm_interrupt();
+    }
+}
+
+bm_trap bm_context_trap(const bm_context *ctx) {
+    return ctx != nullptr ? static_cast<bm_trap>(ctx->trap) : BM_TRAP_OK;
+}
+
+bm_status bm_set_output(bm_context *ctx, const bm_output_fn fn, void *user) {
+    if (ctx == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    Output &output = ctx->vm.get_output();
+    if (fn == nullptr) {
+        output.set_sink(nullptr, nullptr);
+        output.set_file(nullptr);
+    } else {
+        output.set_sink(fn, user);
+    }
+    return BM_OK;
+}
+
+bm_status bm_set_heap_limit(bm_context *ctx, const size_t limit) {
+    if (ctx == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    ctx->vm.set_heap_limit(limit);
+    return BM_OK;
+}
+
+const uint8_t *bm_heap(const bm_context *ctx, size_t *size) {
+    if (ctx == nullptr) {
+        if (size != nullptr) {
+            *size = 0;
+        }
+        return nullptr;
+    }
+    const auto &heap = ctx->vm.get_heap();
+    if (size != nullptr) {
+        *size = heap.size();
+    }
+    return heap.data();
+}
+
+size_t bm_stack_size(const bm_context *ctx) {
+    return ctx != nullptr ? ctx->vm.get_stack().size() : 0;
+}
+
+bm_status bm_stack_get(const bm_context *ctx, const size_t index, double *value) {
+    if (ctx == nullptr || value == nullptr) {
+        return BM_ERR_INVALID_ARG;
+    }
+    const auto &stack = ctx->vm.get_stack();
+    if (index >= stack.size()) {
+        return BM_ERR_RANGE;
+    }
+    *value = stack[index];
+    return BM_OK;
+}
+
+} // extern "C"
@@ -0,0 +1,257 @@
+#include "../include/debugger.hpp"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <variant>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace {
+
+bool inst_has_operand(const Inst_type type) {
+    switch (type) {
+        case Inst_type::INST_PUSH:
+        case Inst_type::INST_DUP:
+        case Inst_type::INST_SWAP:
+        case Inst_type::INST_JMP:
+        case Inst_type::INST_JMP_IF:
+        case Inst_type::INST_CALL:
+        case Inst_type::INST_SPAWN:
+        case Inst_type::INST_NATIVE:
+        case Inst_type::INST_ENTER:
+        case Inst_type::INST_LOAD_LOCAL:
+        case Inst_type::INST_STORE_LOCAL:
+        case Inst_type::INST_TCALL:
+        case Inst_type::INST_SHL:
+        case Inst_type::INST_SHR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::string operand_as_str(const Operand &operand) {
+    std::ostringstream out;
+    if (std::holds_alternative<i64>(operand)) {
+        out << std::get<i64>(operand);
+    } else if (std::holds_alternative<f64>(operand)) {
+        out << std::get<f64>(operand);
+    } else if (std::holds_alternative<std::string>(operand)) {
+        out << std::get<std::string>(operand);
+    } else {
+        const auto &[a, b] = std::get<std::pair<i64, i64>>(operand);
+        out << a << ' ' << b;
+    }
+    return out.str();
+}
+
+} // namespace
+
+Debugger::Debugger(VM &vm) : m_vm(vm) {}
+
+bool Debugger::resolve_addr(const std::string &name, i64 &addr) const {
+    const auto &labels = m_vm.get_labels();
+    if (labels.has_value()) {
+        if (const auto it = labels->find(name); it != labels->end()) {
+            addr = it->second;
+            return true;
+        }
+    }
+    try {
+        size_t used{};
+        addr = std::stoll(name, &used);
+        return used == name.size();
+    } catch (const std::exception &) {
+        return false;
+    }
+}
+
+// Renders an address as the closest preceding label plus an offset, e.g. "loop+2"
+std::string Debugger::describe_addr(const i64 addr) const {
+    const std::string *best = nullptr;
+    i64 best_loc = -1;
+    if (const auto &labels = m_vm.get_labels(); labels.has_value()) {
+        for (const auto &[name, loc] : *labels) {
+            if (loc <= addr && (loc > best_loc || (loc == best_loc && name < *best))) {
+                best = &name;
+                best_loc = loc;
+            }
+        }
+    }
+
+    std::string result = std::to_string(addr);
+    if (best != nullptr) {
+        result += " <" + *best;
+        if (addr != best_loc) {
+            result += "+" + std::to_string(addr - best_loc);
+        }
+        result += ">";
+    }
+    return result;
+}
+
+bool Debugger::set_breakpoint(const i64 addr) {
+    if (addr < 0 || static_cast<size_t>(addr) >= m_vm.get_program_size() || m_breakpoints.count(addr) != 0) {
+        return false;
+    }
+    m_breakpoints.emplace(addr, m_vm.vm_inst_at(addr));
+    m_vm.vm_patch_inst(addr, inst_break());
+    return true;
+}
+
+bool Debugger::clear_breakpoint(const i64 addr) {
+    const auto it = m_breakpoints.find(addr);
+    if (it == m_breakpoints.end()) {
+        return false;
+    }
+    m_vm.vm_patch_inst(addr, it->second);
+    m_breakpoints.erase(it);
+    return true;
+}
+
+Trap Debugger::step() {
+    if (m_vm.get_halt()) {
+        return Trap::TRAP_OK;
+    }
+    // The breakpoint stays patched in; the original instruction is executed out of line
+    const auto it = m_breakpoints.find(m_vm.get_ip());
+    const Trap trap = it != m_breakpoints.end() ? m_vm.vm_execute_inst(it->second) : m_vm.vm_step();
+    m_vm.vm_flush_output();
+    return trap;
+}
+
+Run_result Debugger::cont() {
+    if (const Trap trap = step(); trap != Trap::TRAP_OK) {
+        return Run_result{Run_status::RUN_TRAPPED, trap, 1};
+    }
+    m_vm.vm_clear_interrupt();
+    m_running.store(true);
+    const Run_result result = m_vm.vm_run(UINT64_MAX);
+    m_running.store(false);
+    return result;
+}
+
+void Debugger::interrupt() noexcept {
+    if (m_running.load()) {
+        m_vm.vm_interrupt();
+        return;
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    static constexpr char notice[] = "\n(Ctrl-C only stops a running continue, type 'quit' to leave)\n(bm) ";
+    (void)::write(STDOUT_FILENO, notice, sizeof(notice) - 1);
+#endif
+}
+
+void Debugger::print_location(std::ostream &out) const {
+    const i64 ip = m_vm.get_ip();
+    out << describe_addr(ip);
+    if (ip >= 0 && static_cast<size_t>(ip) < m_vm.get_program_size()) {
+        const auto it = m_breakpoints.find(ip);
+        const Instruction &inst = it != m_breakpoints.end() ? it->second : m_vm.vm_inst_at(ip);
+        out << ": " << inst_as_str(inst.type);
+        if (inst_has_operand(inst.type)) {
+            out << ' ' << operand_as_str(inst.operand);
+        }
+    }
+    out << '\n';
+}
+
+void Debugger::print_stack(std::ostream &out) const {
+    out << "Stack:\n";
+    if (m_vm.get_stack().empty()) {
+        out << "[empty]\n";
+    }
+    for (const f64 value : m_vm.get_stack()) {
+        out << "  " << value << '\n';
+    }
+}
+
+void Debugger::print_call_stack(std::ostream &out) const {
+    out << "  #0 " << describe_addr(m_vm.get_ip()) << '\n';
+    const auto &calls = m_vm.get_call_stack();
+    for (size_t i = calls.size(); i-- > 0;) {
+        // Return addresses point past the call, show the call site itself
+        out << "  #" << calls.size() - i << ' ' << describe_addr(calls[i] - 1) << '\n';
+    }
+}
+
+void Debugger::report(const Trap trap, std::ostream &out) const {
+    if (trap == Trap::TRAP_BREAKPOINT) {
+        out << "Breakpoint at ";
+        print_location(out);
+    } else if (trap != Trap::TRAP_OK) {
+        out << "Trap " << trap_as_str(trap) << " at ";
+        print_location(out);
+    } else if (m_vm.get_halt()) {
+        out << "Program halted\n";
+    } else {
+        print_location(out);
+    }
+}
+
+void Debugger::repl(std::istream &in, std::ostream &out) {
+    out << "bm debugger, type 'help' for commands\n";
+    print_location(out);
+
+    std::string line;
+    while (out << "(bm) " << std::flush, std::getline(in, line)) {
+        std::istringstream words(line);
+        std::string cmd, arg;
+        words >> cmd >> arg;
+
+        if (cmd.empty()) {
+            continue;
+        } else if (cmd == "help" || cmd == "h") {
+            out << "  break|b <label|ip>   set a breakpoint\n"
+                << "  delete|d <label|ip>  remove a breakpoint\n"
+                << "  step|s [n]           execute n instructions (default 1)\n"
+                << "  continue|c           run until a breakpoint, trap, halt or Ctrl-C\n"
+                << "  stack                print the operand stack\n"
+                << "  backtrace|bt         print the call stack\n"
+                << "  where|w              print the current instruction\n"
+                << "  quit|q               leave the debugger\n";
+        } else if (cmd == "break" || cmd == "b" || cmd == "delete" || cmd == "d") {
+            i64 addr{};
+            if (!resolve_addr(arg, addr)) {
+                out << "Unknown label or address: " << arg << '\n';
+            } else if (cmd == "break" || cmd == "b") {
+                out << (set_breakpoint(addr) ? "Breakpoint set at " : "Cannot set breakpoint at ") << describe_addr(addr) << '\n';
+            } else {
+                out << (clear_breakpoint(addr) ? "Breakpoint removed at " : "No breakpoint at ") << describe_addr(addr) << '\n';
+            }
+        } else if (cmd == "step" || cmd == "s") {
+            long count = 1;
+            if (!arg.empty()) {
+                try {
+                    count = std::stol(arg);
+                } catch (const std::exception &) {
+                    out << "Invalid step count: " << arg << '\n';
+                    continue;
+                }
+            }
+            Trap trap = Trap::TRAP_OK;
+            for (long n = 0; n < count && trap == Trap::TRAP_OK && !m_vm.get_halt(); ++n) {
+                trap = step();
+            }
+            report(trap, out);
+        } else if (cmd == "continue" || cmd == "c") {
+            if (const Run_result result = cont(); result.status == Run_status::RUN_YIELDED) {
+                out << "Interrupted at ";
+                print_location(out);
+            } else {
+                report(result.trap, out);
+            }
+        } else if (cmd == "stack") {
+            print_stack(out);
+        } else if (cmd == "backtrace" || cmd == "bt") {
+            print_call_stack(out);
+        } else if (cmd == "where" || cmd == "w") {
+            print_location(out);
+        } else if (cmd == "quit" || cmd == "q") {
+            break;
+        } else {
+            out << "Unknown command: " << cmd << '\n';
+        }
+    }
+}
@@ -1,12 +1,22 @@
 #include <cassert>
+#include <csignal>
+#include <cstdio>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 #include "../include/vm.hpp"
+#include "../include/debugger.hpp"
+#include "../include/scheduler.hpp"
+#include "../include/regvm.hpp"
+#include "../include/aot.hpp"
+#ifdef BM_SERVER
+#include "../include/server.hpp"
+#endif
 
 [[nodiscard]] std::string slurp_file(const std::string &file_path) {
     std::fstream file(file_path, std::ios::in);
@@ -26,53 +36,307 @@
     }
 }
 
-static VM vm{};
+static volatile std::sig_atomic_t g_signal = 0;
+static VM *g_running = nullptr;
+static Scheduler *g_scheduler = nullptr;
+static Debugger *g_debugger = nullptr;
+
+static std::string read_captured(std::FILE *file) {
+    std::string contents;
+    std::rewind(file);
+    char chunk[4096];
+    size_t n = 0;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        contents.append(chunk, n);
+    }
+    std::fclose(file);
+    return contents;
+}
+
+// Runs the program from its current state on both engines and reports any difference,
+// including in what print_debug wrote, which is printed once afterwards
+static bool check_engines(const VM &vm, const uint64_t max_steps) {
+    VM stack_vm{vm.get_program()};
+    VM reg_vm{vm.get_program()};
+    if (const auto &labels = vm.get_labels(); labels.has_value()) {
+        stack_vm.set_labels(*labels);
+        reg_vm.set_labels(*labels);
+    }
+    stack_vm.set_natives(vm.get_natives());
+    reg_vm.set_natives(vm.get_natives());
+    stack_vm.set_heap_limit(vm.get_heap_limit());
+    reg_vm.set_heap_limit(vm.get_heap_limit());
+    stack_vm.set_ip(vm.get_ip());
+    reg_vm.set_ip(vm.get_ip());
+    stack_vm.get_output().set_format(vm.get_output().get_format());
+    reg_vm.get_output().set_format(vm.get_output().get_format());
+
+    std::FILE *stack_file = std::tmpfile();
+    std::FILE *reg_file = std::tmpfile();
+    if (stack_file == nullptr || reg_file == nullptr) {
+        std::cerr << "Error: Could not create a temporary file.\n";
+        return false;
+    }
+    stack_vm.get_output().set_file(stack_file);
+    reg_vm.get_output().set_file(reg_file);
+
+    const Run_result expected = stack_vm.vm_run(max_steps);
+    Reg_engine engine(reg_vm);
+    const Run_result actual = engine.run(reg_vm, max_steps);
+    const std::string expected_output = read_captured(stack_file);
+    const std::string actual_output = read_captured(reg_file);
+    std::fwrite(expected_output.data(), 1, expected_output.size(), stdout);
+    std::fflush(stdout);
+
+    const auto &a = stack_vm.get_stack();
+    const auto &b = reg_vm.get_stack();
+    const bool same = expected.status == actual.status && expected.trap == actual.trap &&
+                      expected.steps == actual.steps && stack_vm.get_ip() == reg_vm.get_ip() &&
+                      stack_vm.get_halt() == reg_vm.get_halt() &&
+                      stack_vm.get_call_stack() == reg_vm.get_call_stack() &&
+                      stack_vm.get_heap() == reg_vm.get_heap() && a.size() == b.size() &&
+                      std::memcmp(a.data(), b.data(), a.size() * sizeof(f64)) == 0 &&
+                      expected_output == actual_output;
+    if (!same) {
+        std::cerr << "Engines disagree.\nstack engine: " << trap_as_str(expected.trap) << " after "
+                  << expected.steps << " steps\n";
+        stack_vm.vm_dump_state(std::cerr);
+        std::cerr << "register engine: " << trap_as_str(actual.trap) << " after " << actual.steps << " steps\n";
+        reg_vm.vm_dump_state(std::cerr);
+        if (expected_output != actual_output) {
+            std::cerr << "Printed output differs (" << expected_output.size() << " and " << actual_output.size()
+                      << " bytes).\n";
+        }
+        return false;
+    }
+    std::cout << "Engines agree after " << expected.steps << " steps.\n";
+    return true;
+}
+
+static void on_signal(int sig) {
+    g_signal = sig;
+    if (g_running != nullptr) {
+        g_running->vm_interrupt();
+    }
+    if (g_debugger != nullptr) {
+        g_debugger->interrupt();
+    }
+    if (g_scheduler != nullptr) {
+        g_scheduler->interrupt();
+    }
+}
 
 int main(int argc, char *argv[]) {
-    
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    VM vm{};
+    bool debug = false;
+    bool reg_engine = false;
+    bool check = false;
+    bool dump_ir = false;
+    bool binary_output = false;
+    bool emit_cpp = false;
+    bool check_aot = false;
+    bool steps_given = false;
+    bool async_output = false;
+    uint64_t max_steps = 69;
+    unsigned threads = std::thread::hardware_concurrency();
     for (size_t i = 0; i < argc; ++i) {
 
+        // Translate to C++ (--emit-cpp) or check the translation against the interpreter (--aot-check)
+        if ((strcmp(argv[i], "--emit-cpp") == 0 || strcmp(argv[i], "--aot-check") == 0) && i + 1 < argc) {
+            emit_cpp = emit_cpp || strcmp(argv[i], "--emit-cpp") == 0;
+            check_aot = check_aot || strcmp(argv[i], "--aot-check") == 0;
+            vm.set_memory(slurp_file(argv[i + 1]));
+            if (!vm.vm_translate_asm()) {
+                std::cerr << "Error: " << vm.get_error() << '\n';
+                return EXIT_FAILURE;
+            }
+            vm.set_ip(vm.get_label_loc("start"));
+        }
+
         //  Read in human-readable assembly instructions
         if (strcmp(argv[i], "-c") == 0) {
             std::string src = slurp_file(argv[i + 1]);
             vm.set_memory(src);
-            vm.vm_translate_asm();
+            if (!vm.vm_translate_asm()) {
+                std::cerr << "Error: " << vm.get_error() << '\n';
+                return EXIT_FAILURE;
+            }
             vm.set_ip(vm.get_label_loc("start"));
             //vm.set_ip(0);
         }
         // Load in precompiled instructions
         if (strcmp(argv[i], "-i") == 0) {
-            vm.vm_load_program_from_file(argv[i+1]);
-            vm.set_ip(0);
+            if (!vm.vm_load_program_from_file(argv[i+1])) {
+                std::cerr << "Error: " << vm.get_error() << '\n';
+                return EXIT_FAILURE;
+            }
+            std::cout << "Program successfully loaded from " << argv[i + 1] << '\n';
+            vm.set_ip(vm.get_label_loc("start"));
         }
 
         // Save instructions to a file
         if (strcmp(argv[i], "-o") == 0) {
-            vm.vm_save_program_to_file(argv[i + 1]);
+            if (!vm.vm_save_program_to_file(argv[i + 1])) {
+                std::cerr << "Error: " << vm.get_error() << '\n';
+                return EXIT_FAILURE;
+            }
+            std::cout << "Program successfully saved to " << argv[i + 1] << '\n';
+        }
+
+#ifdef BM_SERVER
+        // Serve execution requests on a Unix socket until interrupted
+        if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --serve requires a socket path.\n";
+                return EXIT_FAILURE;
+            }
+            return bm_serve(argv[i + 1], std::thread::hardware_concurrency(), g_signal) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+#endif
+
+        // Instruction budget for the run, 0 for no limit
+        if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            max_steps = std::strtoull(argv[i + 1], nullptr, 10);
+            steps_given = true;
+            if (max_steps == 0) {
+                max_steps = UINT64_MAX;
+            }
+        }
+
+        // Maximum heap size in bytes for alloc
+        if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc) {
+            vm.set_heap_limit(std::strtoull(argv[i + 1], nullptr, 10));
+        }
+
+        // Worker threads for programs that spawn fibers
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::strtoul(argv[i + 1], nullptr, 10));
+        }
+
+        // Execution engine: "stack" (reference) or "reg" (translated register IR)
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "reg") == 0) {
+                reg_engine = true;
+            } else if (strcmp(argv[i + 1], "stack") != 0) {
+                std::cerr << "Error: Unknown engine '" << argv[i + 1] << "'.\n";
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Run on both engines and compare the final states
+        if (strcmp(argv[i], "--check-engines") == 0) {
+            check = true;
+        }
+
+        // Print the register IR before running with --engine reg
+        if (strcmp(argv[i], "--dump-ir") == 0) {
+            dump_ir = true;
+        }
+
+        // print_debug writes raw doubles instead of text, and the final stack dump is skipped
+        if (strcmp(argv[i], "--binary-output") == 0) {
+            binary_output = true;
+        }
+
+        // Hand output to a background writer thread
+        if (strcmp(argv[i], "--async-output") == 0) {
+            async_output = true;
+        }
+
+        // Run under the interactive debugger
+        if (strcmp(argv[i], "--debug") == 0) {
+            debug = true;
         }
     }
-    
-    for (size_t i = 0; i < 69 && !vm.get_halt(); ++i) {
-        if (vm.get_program().empty()) {
+
+    if (debug) {
+        if (vm.get_program_size() == 0) {
             std::cerr << "Error: Program is empty.\n";
             return EXIT_FAILURE;
         }
-        
-        //if (vm.ip >= vm.program.size()) {
-        //    std::cerr << "Error: Instruction pointer out of bounds (ip=" << vm.ip
-        //              << ", size=" << vm.program.size() << ").\n";
-        //    return EXIT_FAILURE;
-        //}
-        
-        Instruction curr_inst = vm.get_program().at(vm.get_ip());
-        Trap trap = vm.vm_execute_inst(curr_inst);
-        if (trap != Trap::TRAP_OK) {
-            std::cerr << "ERROR: " << trap_as_str(trap) << '\n';
+        // SIGINT/SIGTERM stop a `continue` and drop back to the prompt
+        Debugger debugger(vm);
+        g_debugger = &debugger;
+        debugger.repl(std::cin, std::cout);
+        g_debugger = nullptr;
+        return EXIT_SUCCESS;
+    }
+    
+    if (vm.get_program_size() == 0) {
+        std::cerr << "Error: Program is empty.\n";
+        return EXIT_FAILURE;
+    }
+
+    if (emit_cpp) {
+        std::string error;
+        if (!aot_emit_cpp(vm, std::cout, error)) {
+            std::cerr << "Error: " << error << '\n';
             return EXIT_FAILURE;
         }
+        return EXIT_SUCCESS;
+    }
+    if (check_aot) {
+#ifdef BM_AOT_CHECK
+        // Default to a budget that finishes any sample program but not an infinite loop
+        return aot_check(vm, steps_given ? max_steps : 100'000'000, std::cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+        std::cerr << "Error: --aot-check is not available on this platform.\n";
+        return EXIT_FAILURE;
+#endif
+    }
+
+    if (binary_output) {
+        vm.get_output().set_format(Output_format::OUTPUT_BINARY);
+    }
+    if (async_output) {
+        vm.get_output().start_writer();
+    }
+
+    if (check) {
+        return check_engines(vm, max_steps) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    Run_result result{};
+    if (program_uses_fibers(vm)) {
+        // Fibers run until the main fiber halts; an explicit --steps caps all fibers together
+        Scheduler scheduler(vm, threads);
+        g_scheduler = &scheduler;
+        result = scheduler.run(vm, steps_given ? max_steps : UINT64_MAX);
+        g_scheduler = nullptr;
+        if (result.status == Run_status::RUN_TRAPPED && result.trap != Trap::TRAP_DEADLOCK) {
+            std::cerr << "In fiber " << scheduler.get_trapped_fiber() << ":\n";
+        }
+    } else if (reg_engine) {
+        Reg_engine engine(vm);
+        if (dump_ir) {
+            engine.dump(std::cout);
+        }
+        g_running = &vm;
+        result = engine.run(vm, max_steps);
+        g_running = nullptr;
+    } else {
+        g_running = &vm;
+        result = vm.vm_run(max_steps);
+        g_running = nullptr;
+    }
+
+    if (result.status == Run_status::RUN_TRAPPED) {
+        std::cerr << "ERROR: " << trap_as_str(result.trap) << '\n';
+        vm.vm_dump_state(std::cerr);
+        return EXIT_FAILURE;
+    }
+    if (g_signal != 0) {
+        std::cerr << "Interrupted by signal " << g_signal << '\n';
+        vm.vm_dump_state(std::cerr);
+        return EXIT_FAILURE;
     }
     
     // vm_dump_stack(vm);
-    vm.vm_dump_stack();
+    if (!binary_output) {
+        vm.vm_dump_stack();
+    }
     return EXIT_SUCCESS;
 }
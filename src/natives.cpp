@@ -0,0 +1,50 @@
+#include "../include/vm.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+template <f64 (*F)(f64)>
+Trap unary(const f64 *args, f64 *results, void *) {
+    results[0] = F(args[0]);
+    return Trap::TRAP_OK;
+}
+
+template <f64 (*F)(f64, f64)>
+Trap binary(const f64 *args, f64 *results, void *) {
+    results[0] = F(args[0], args[1]);
+    return Trap::TRAP_OK;
+}
+
+f64 bm_sqrt(const f64 x) { return std::sqrt(x); }
+f64 bm_sin(const f64 x) { return std::sin(x); }
+f64 bm_cos(const f64 x) { return std::cos(x); }
+f64 bm_tan(const f64 x) { return std::tan(x); }
+f64 bm_exp(const f64 x) { return std::exp(x); }
+f64 bm_log(const f64 x) { return std::log(x); }
+f64 bm_floor(const f64 x) { return std::floor(x); }
+f64 bm_ceil(const f64 x) { return std::ceil(x); }
+f64 bm_abs(const f64 x) { return std::fabs(x); }
+f64 bm_pow(const f64 x, const f64 y) { return std::pow(x, y); }
+f64 bm_min(const f64 x, const f64 y) { return std::min(x, y); }
+f64 bm_max(const f64 x, const f64 y) { return std::max(x, y); }
+
+} // namespace
+
+const std::vector<Native> &builtin_natives() {
+    static const std::vector<Native> natives{
+        {"sqrt", unary<bm_sqrt>, 1, 1, nullptr},
+        {"sin", unary<bm_sin>, 1, 1, nullptr},
+        {"cos", unary<bm_cos>, 1, 1, nullptr},
+        {"tan", unary<bm_tan>, 1, 1, nullptr},
+        {"exp", unary<bm_exp>, 1, 1, nullptr},
+        {"log", unary<bm_log>, 1, 1, nullptr},
+        {"pow", binary<bm_pow>, 2, 1, nullptr},
+        {"floor", unary<bm_floor>, 1, 1, nullptr},
+        {"ceil", unary<bm_ceil>, 1, 1, nullptr},
+        {"abs", unary<bm_abs>, 1, 1, nullptr},
+        {"min", binary<bm_min>, 2, 1, nullptr},
+        {"max", binary<bm_max>, 2, 1, nullptr},
+    };
+    return natives;
+}
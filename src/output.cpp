@@ -0,0 +1,196 @@
+#include "../include/output.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+Byte_ring::Byte_ring(const size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_data.reset(new char[size]);
+    m_mask = size - 1;
+}
+
+size_t Byte_ring::push(const char *data, const size_t len) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    const size_t n = std::min(len, m_mask + 1 - (head - tail));
+    const size_t at = head & m_mask;
+    const size_t first = std::min(n, m_mask + 1 - at);
+    std::memcpy(m_data.get() + at, data, first);
+    std::memcpy(m_data.get(), data + first, n - first);
+    m_head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+size_t Byte_ring::pop(char *data, const size_t len) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    const size_t n = std::min(len, head - tail);
+    const size_t at = tail & m_mask;
+    const size_t first = std::min(n, m_mask + 1 - at);
+    std::memcpy(data, m_data.get() + at, first);
+    std::memcpy(data + first, m_data.get(), n - first);
+    m_tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+bool Byte_ring::full() const {
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire) == m_mask + 1;
+}
+
+bool Byte_ring::empty() const {
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+}
+
+Output::Output(std::FILE *file) : m_file(file) {}
+
+Output::~Output() {
+    flush();
+    stop_writer();
+}
+
+void Output::set_file(std::FILE *file) & {
+    flush();
+    stop_writer();
+    m_file = file;
+}
+
+void Output::set_sink(const Output_sink sink, void *user) & {
+    flush();
+    stop_writer(); // The writer thread reads the sink without synchronization
+    m_sink = sink;
+    m_sink_user = user;
+}
+
+void Output::set_format(const Output_format format) & { m_format = format; }
+Output_format Output::get_format() const& { return m_format; }
+
+void Output::start_writer(const size_t ring_size) {
+    if (m_writer.joinable()) {
+        return;
+    }
+    flush();
+    m_ring = std::make_unique<Byte_ring>(ring_size);
+    m_stop = false;
+    m_writer = std::thread(&Output::writer_loop, this);
+}
+
+void Output::stop_writer() {
+    if (!m_writer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_wait_mutex);
+        m_stop = true;
+    }
+    m_data_cv.notify_one();
+    m_writer.join();
+    m_ring.reset();
+}
+
+void Output::writer_loop() {
+    std::unique_ptr<char[]> chunk(new char[BUFFER_SIZE]);
+    while (true) {
+        const size_t n = m_ring->pop(chunk.get(), BUFFER_SIZE);
+        if (n > 0) {
+            {
+                std::lock_guard<std::mutex> lock(m_wait_mutex);
+            }
+            m_space_cv.notify_one();
+            emit(chunk.get(), n);
+            continue;
+        }
+        if (m_sink == nullptr && m_file != nullptr) {
+            std::fflush(m_file);
+        }
+        std::unique_lock<std::mutex> lock(m_wait_mutex);
+        m_data_cv.wait(lock, [this] { return m_stop || !m_ring->empty(); });
+        if (m_stop && m_ring->empty()) {
+            break; // The ring was empty after the stop request, nothing can follow
+        }
+    }
+}
+
+void Output::emit(const char *data, const size_t len) {
+    if (m_sink != nullptr) {
+        m_sink(data, len, m_sink_user);
+    } else if (m_file != nullptr) {
+        std::fwrite(data, 1, len, m_file);
+    }
+}
+
+void Output::write_out(const char *data, size_t len) {
+    if (m_ring == nullptr) {
+        emit(data, len);
+        if (m_sink == nullptr && m_file != nullptr) {
+            std::fflush(m_file);
+        }
+        return;
+    }
+    while (len > 0) {
+        const size_t n = m_ring->push(data, len);
+        data += n;
+        len -= n;
+        {
+            // Taking the lock orders the push before the writer's emptiness check, so no wakeup is lost
+            std::lock_guard<std::mutex> lock(m_wait_mutex);
+        }
+        m_data_cv.notify_one();
+        if (len > 0) {
+            std::unique_lock<std::mutex> lock(m_wait_mutex); // Ring full, wait for the writer to make room
+            m_space_cv.wait(lock, [this] { return !m_ring->full(); });
+        }
+    }
+}
+
+char *Output::buffer() {
+    if (m_buffer == nullptr) {
+        m_buffer.reset(new char[BUFFER_SIZE]); // Not value-initialized, only m_size bytes are ever read
+    }
+    return m_buffer.get();
+}
+
+void Output::write_value(const double value) {
+    if (m_format == Output_format::OUTPUT_BINARY) {
+        if (BUFFER_SIZE - m_size < sizeof(value)) {
+            flush();
+        }
+        std::memcpy(buffer() + m_size, &value, sizeof(value));
+        m_size += sizeof(value);
+        return;
+    }
+    write_number(value);
+    buffer()[m_size++] = '\n';
+}
+
+void Output::write_number(const double value) {
+    // Longest %g output at precision 6 is 13 bytes ("-1.23457e+308"), plus room for a newline
+    if (BUFFER_SIZE - m_size < 32) {
+        flush();
+    }
+    char *begin = buffer();
+    const auto result = std::to_chars(begin + m_size, begin + BUFFER_SIZE, value, std::chars_format::general, 6);
+    m_size = static_cast<size_t>(result.ptr - begin);
+}
+
+void Output::write(const std::string_view text) {
+    if (BUFFER_SIZE - m_size < text.size()) {
+        flush();
+        if (text.size() > BUFFER_SIZE) {
+            write_out(text.data(), text.size());
+            return;
+        }
+    }
+    std::memcpy(buffer() + m_size, text.data(), text.size());
+    m_size += text.size();
+}
+
+void Output::flush() {
+    if (m_size == 0) {
+        return;
+    }
+    write_out(m_buffer.get(), m_size);
+    m_size = 0;
+}
@@ -0,0 +1,503 @@
+#include "../include/regvm.hpp"
+#include <algorithm>
+#include <variant>
+
+namespace {
+
+constexpr int32_t TEMP_MARK = 1 << 30; // Operands at or above this are temporaries awaiting a register
+
+// A value on the translator's virtual stack
+struct Val {
+    enum Kind : uint8_t { SLOT, TEMP, CONST } kind;
+    int32_t idx; // SLOT: register below the entry stack pointer, TEMP: temporary number
+    f64 imm;
+};
+
+bool is_translatable(const Instruction &inst) {
+    switch (inst.type) {
+        case Inst_type::INST_NOP:
+        case Inst_type::INST_DROP:
+        case Inst_type::INST_PLUS:
+        case Inst_type::INST_MINUS:
+        case Inst_type::INST_MULT:
+        case Inst_type::INST_EQ:
+        case Inst_type::INST_NOT:
+        case Inst_type::INST_XOR:
+        case Inst_type::INST_AND:
+        case Inst_type::INST_OR:
+            return true;
+        case Inst_type::INST_PUSH:
+            return std::holds_alternative<i64>(inst.operand) || std::holds_alternative<f64>(inst.operand);
+        case Inst_type::INST_DUP:
+        case Inst_type::INST_SWAP:
+            return std::holds_alternative<i64>(inst.operand) && std::get<i64>(inst.operand) >= 0;
+        default:
+            return false;
+    }
+}
+
+const char *reg_op_as_str(const Reg_op op) {
+    switch (op) {
+        case Reg_op::REG_MOVE:
+            return "move";
+        case Reg_op::REG_CONST:
+            return "const";
+        case Reg_op::REG_ADD:
+            return "add";
+        case Reg_op::REG_SUB:
+            return "sub";
+        case Reg_op::REG_MUL:
+            return "mul";
+        case Reg_op::REG_EQ:
+            return "eq";
+        case Reg_op::REG_NOT:
+            return "not";
+        case Reg_op::REG_XOR:
+            return "xor";
+        case Reg_op::REG_AND:
+            return "and";
+        case Reg_op::REG_OR:
+            return "or";
+    }
+    return "?";
+}
+
+// Same arithmetic as the stack VM so folded constants are bit-identical
+f64 eval(const Reg_op op, const f64 a, const f64 b) {
+    switch (op) {
+        case Reg_op::REG_ADD:
+            return a + b;
+        case Reg_op::REG_SUB:
+            return a - b;
+        case Reg_op::REG_MUL:
+            return a * b;
+        case Reg_op::REG_EQ:
+            return b == a;
+        case Reg_op::REG_NOT:
+            return !a;
+        case Reg_op::REG_XOR:
+            return static_cast<f64>(static_cast<i64>(b) ^ static_cast<i64>(a));
+        case Reg_op::REG_AND:
+            return static_cast<f64>(static_cast<i64>(b) & static_cast<i64>(a));
+        case Reg_op::REG_OR:
+            return static_cast<f64>(static_cast<i64>(b) | static_cast<i64>(a));
+        default:
+            return a;
+    }
+}
+
+} // namespace
+
+Reg_engine::Reg_engine(const VM &vm)
+    : m_program(vm.get_program()),
+      m_targets(m_program.size(), -1),
+      m_leaders(m_program.size() + 1, false),
+      m_blocks(m_program.size()) {
+    const auto &labels = vm.get_labels();
+    if (labels.has_value()) {
+        for (const auto &[name, loc] : *labels) {
+            if (loc >= 0 && static_cast<size_t>(loc) < m_leaders.size()) {
+                m_leaders[loc] = true;
+            }
+        }
+    }
+    if (!m_leaders.empty()) {
+        m_leaders[0] = true;
+    }
+
+    for (size_t ip = 0; ip < m_program.size(); ++ip) {
+        const Instruction &inst = m_program[ip];
+        if ((inst.type == Inst_type::INST_JMP || inst.type == Inst_type::INST_JMP_IF) &&
+            std::holds_alternative<std::string>(inst.operand) && labels.has_value()) {
+            if (const auto it = labels->find(std::get<std::string>(inst.operand)); it != labels->end()) {
+                m_targets[ip] = it->second;
+            }
+        }
+        if (!is_translatable(inst)) {
+            m_leaders[ip + 1] = true;
+        }
+    }
+
+    for (size_t ip = 0; ip < m_program.size(); ++ip) {
+        if (m_leaders[ip]) {
+            m_blocks[ip] = translate(static_cast<i64>(ip));
+        }
+    }
+}
+
+std::unique_ptr<Reg_block> Reg_engine::translate(const i64 start) const {
+    auto block = std::make_unique<Reg_block>();
+    block->start = start;
+    block->exit = Reg_exit::EXIT_FALLTHROUGH;
+    block->cond = 0;
+    block->taken = 0;
+
+    std::vector<Val> vs;
+    std::vector<Reg_inst> &code = block->code;
+    int32_t consumed = 0;
+    int32_t temps = 0;
+
+    // Pull values from below the entry stack pointer until vs[size - 1 - k] exists
+    const auto ensure = [&](const size_t k) {
+        while (vs.size() <= k) {
+            ++consumed;
+            vs.insert(vs.begin(), Val{Val::SLOT, -consumed, 0});
+        }
+    };
+    const auto pop = [&]() {
+        ensure(0);
+        const Val v = vs.back();
+        vs.pop_back();
+        return v;
+    };
+    const auto reg = [&](const Val &v) -> int32_t {
+        if (v.kind == Val::SLOT) {
+            return v.idx;
+        }
+        if (v.kind == Val::TEMP) {
+            return TEMP_MARK + v.idx;
+        }
+        const int32_t t = temps++;
+        code.push_back(Reg_inst{Reg_op::REG_CONST, TEMP_MARK + t, 0, 0, v.imm});
+        return TEMP_MARK + t;
+    };
+    const auto unary = [&](const Reg_op op) {
+        const Val a = pop();
+        if (a.kind == Val::CONST) {
+            vs.push_back(Val{Val::CONST, 0, eval(op, a.imm, 0)});
+            return;
+        }
+        const int32_t ra = reg(a);
+        const int32_t t = temps++;
+        code.push_back(Reg_inst{op, TEMP_MARK + t, ra, 0, 0});
+        vs.push_back(Val{Val::TEMP, t, 0});
+    };
+    // a is the second value from the top, b the top, matching the stack VM's operand order
+    const auto binary = [&](const Reg_op op) {
+        ensure(1);
+        const Val b = pop();
+        const Val a = pop();
+        if (a.kind == Val::CONST && b.kind == Val::CONST) {
+            vs.push_back(Val{Val::CONST, 0, eval(op, a.imm, b.imm)});
+            return;
+        }
+        const int32_t ra = reg(a);
+        const int32_t rb = reg(b);
+        const int32_t t = temps++;
+        code.push_back(Reg_inst{op, TEMP_MARK + t, ra, rb, 0});
+        vs.push_back(Val{Val::TEMP, t, 0});
+    };
+
+    i64 ip = start;
+    uint64_t extra = 0; // Translated terminator
+    Val cond{Val::CONST, 0, 0};
+    const i64 size = static_cast<i64>(m_program.size());
+    for (; ip < size; ++ip) {
+        if (ip != start && m_leaders[ip]) {
+            break;
+        }
+        const Instruction &inst = m_program[ip];
+        if (is_translatable(inst)) {
+            switch (inst.type) {
+                case Inst_type::INST_NOP:
+                    break;
+                case Inst_type::INST_PUSH:
+                    vs.push_back(Val{Val::CONST, 0, std::holds_alternative<i64>(inst.operand)
+                                                        ? static_cast<f64>(std::get<i64>(inst.operand))
+                                                        : std::get<f64>(inst.operand)});
+                    break;
+                case Inst_type::INST_DUP: {
+                    const auto n = static_cast<size_t>(std::get<i64>(inst.operand));
+                    ensure(n);
+                    vs.push_back(vs[vs.size() - 1 - n]);
+                    break;
+                }
+                case Inst_type::INST_SWAP: {
+                    const auto n = static_cast<size_t>(std::get<i64>(inst.operand));
+                    ensure(std::max<size_t>(n, 1));
+                    std::swap(vs.back(), vs[vs.size() - 1 - n]);
+                    break;
+                }
+                case Inst_type::INST_DROP:
+                    pop();
+                    break;
+                case Inst_type::INST_PLUS:
+                    binary(Reg_op::REG_ADD);
+                    break;
+                case Inst_type::INST_MINUS:
+                    binary(Reg_op::REG_SUB);
+                    break;
+                case Inst_type::INST_MULT:
+                    binary(Reg_op::REG_MUL);
+                    break;
+                case Inst_type::INST_EQ:
+                    binary(Reg_op::REG_EQ);
+                    break;
+                case Inst_type::INST_XOR:
+                    binary(Reg_op::REG_XOR);
+                    break;
+                case Inst_type::INST_AND:
+                    binary(Reg_op::REG_AND);
+                    break;
+                case Inst_type::INST_OR:
+                    binary(Reg_op::REG_OR);
+                    break;
+                case Inst_type::INST_NOT:
+                    unary(Reg_op::REG_NOT);
+                    break;
+                default:
+                    break;
+            }
+            continue;
+        }
+
+        if (inst.type == Inst_type::INST_JMP && m_targets[ip] >= 0) {
+            block->exit = Reg_exit::EXIT_JUMP;
+            block->taken = m_targets[ip];
+            extra = 1;
+        } else if (inst.type == Inst_type::INST_JMP_IF && m_targets[ip] >= 0) {
+            cond = pop();
+            block->taken = m_targets[ip];
+            extra = 1;
+            if (cond.kind != Val::CONST) {
+                block->exit = Reg_exit::EXIT_BRANCH;
+            } else if (static_cast<i64>(cond.imm) != 0) {
+                block->exit = Reg_exit::EXIT_JUMP;
+            } else {
+                block->exit = Reg_exit::EXIT_FALLTHROUGH; // Never taken, continue after it
+                ++ip;
+                extra = 0;
+            }
+        } else {
+            block->exit = Reg_exit::EXIT_STACK;
+        }
+        break;
+    }
+    block->end = ip;
+    block->count = static_cast<uint64_t>(ip - start) + extra;
+    if (block->exit == Reg_exit::EXIT_FALLTHROUGH && extra == 0 && ip > start &&
+        m_program[ip - 1].type == Inst_type::INST_JMP_IF) {
+        block->count = static_cast<uint64_t>(ip - start); // The folded jmp_if is already inside [start, end)
+    }
+
+    // Lay out the register window: final stack values first, temporaries above them
+    const int32_t net = static_cast<int32_t>(vs.size()) - consumed;
+    const int32_t temp_base = std::max(0, net);
+    std::vector<int32_t> temp_loc(static_cast<size_t>(temps), -1);
+
+    // A temporary that ends up above the entry stack pointer is computed straight into place
+    for (size_t j = 0; j < vs.size(); ++j) {
+        const int32_t pos = static_cast<int32_t>(j) - consumed;
+        if (vs[j].kind == Val::TEMP && pos >= 0 && temp_loc[vs[j].idx] < 0) {
+            temp_loc[vs[j].idx] = pos;
+        }
+    }
+    for (int32_t t = 0; t < temps; ++t) {
+        if (temp_loc[t] < 0) {
+            temp_loc[t] = temp_base + t;
+        }
+    }
+    const auto loc = [&](const int32_t r) { return r >= TEMP_MARK ? temp_loc[r - TEMP_MARK] : r; };
+    for (auto &inst : code) {
+        inst.dst = loc(inst.dst);
+        inst.a = loc(inst.a);
+        inst.b = loc(inst.b);
+    }
+
+    // Write back the final stack. Entry slots that get overwritten are read into temporaries first.
+    std::vector<bool> written(static_cast<size_t>(consumed), false);
+    for (size_t j = 0; j < vs.size(); ++j) {
+        const int32_t pos = static_cast<int32_t>(j) - consumed;
+        const Val &v = vs[j];
+        const bool in_place = (v.kind == Val::SLOT && v.idx == pos) || (v.kind == Val::TEMP && temp_loc[v.idx] == pos);
+        if (!in_place && pos < 0) {
+            written[pos + consumed] = true;
+        }
+    }
+    int32_t scratch = temp_base + temps;
+    const auto read_early = [&](Val &v) {
+        if (v.kind == Val::SLOT && written[v.idx + consumed]) {
+            code.push_back(Reg_inst{Reg_op::REG_MOVE, scratch, v.idx, 0, 0});
+            v = Val{Val::SLOT, scratch++, 0}; // Now a register above the window's results
+        }
+    };
+    for (size_t j = 0; j < vs.size(); ++j) {
+        const int32_t pos = static_cast<int32_t>(j) - consumed;
+        if (!(vs[j].kind == Val::SLOT && vs[j].idx == pos)) {
+            read_early(vs[j]);
+        }
+    }
+    if (block->exit == Reg_exit::EXIT_BRANCH) {
+        read_early(cond);
+        block->cond = cond.kind == Val::TEMP ? temp_loc[cond.idx] : cond.idx;
+    }
+    for (size_t j = 0; j < vs.size(); ++j) {
+        const int32_t pos = static_cast<int32_t>(j) - consumed;
+        const Val &v = vs[j];
+        if (v.kind == Val::CONST) {
+            code.push_back(Reg_inst{Reg_op::REG_CONST, pos, 0, 0, v.imm});
+        } else {
+            const int32_t src = v.kind == Val::TEMP ? temp_loc[v.idx] : v.idx;
+            if (src != pos) {
+                code.push_back(Reg_inst{Reg_op::REG_MOVE, pos, src, 0, 0});
+            }
+        }
+    }
+
+    block->need = consumed;
+    block->net = net;
+    block->grow = std::max(scratch, net);
+    return block;
+}
+
+const Reg_block &Reg_engine::block_at(const i64 ip) {
+    auto &block = m_blocks[ip];
+    if (block == nullptr) {
+        block = translate(ip); // Entered mid-block, e.g. from the debugger or a fallback step
+    }
+    return *block;
+}
+
+Run_result Reg_engine::run(VM &vm, const uint64_t max_steps) {
+    const Run_result result = run_blocks(vm, max_steps);
+    vm.m_output.flush();
+    return result;
+}
+
+Run_result Reg_engine::run_blocks(VM &vm, const uint64_t max_steps) {
+    std::vector<f64> &stack = vm.m_stack;
+    const i64 size = static_cast<i64>(m_program.size());
+    uint64_t steps = 0;
+
+    while (!vm.m_halt) {
+        if (steps == max_steps) {
+            return Run_result{Run_status::RUN_YIELDED, Trap::TRAP_OK, steps, Yield_reason::YIELD_STEPS};
+        }
+        const i64 ip = vm.m_ip;
+        if (ip < 0 || ip >= size) {
+            return Run_result{Run_status::RUN_TRAPPED, Trap::TRAP_ILLEGAL_INST_ACCESS, steps};
+        }
+
+        const Reg_block &block = block_at(ip);
+        const uint64_t cost = block.count + (block.exit == Reg_exit::EXIT_STACK ? 1 : 0);
+        const size_t depth = stack.size();
+        Inst_type last = Inst_type::INST_NOP;
+
+        if (depth < static_cast<size_t>(block.need) || max_steps - steps < cost) {
+            // Let the reference engine reach the exact trap or budget boundary
+            last = m_program[ip].type;
+            const Trap trap = vm.vm_execute_inst(m_program[ip]);
+            ++steps;
+            if (trap != Trap::TRAP_OK) {
+                return Run_result{Run_status::RUN_TRAPPED, trap, steps};
+            }
+        } else {
+            // Only the block entry is traced, instructions run by the stack engine record themselves
+            vm.m_trace.record(ip, m_program[ip].type, depth != 0 ? stack[depth - 1] : 0.0);
+            stack.resize(depth + block.grow);
+            f64 *r = stack.data() + depth;
+            for (const Reg_inst &op : block.code) {
+                switch (op.op) {
+                    case Reg_op::REG_MOVE:
+                        r[op.dst] = r[op.a];
+                        break;
+                    case Reg_op::REG_CONST:
+                        r[op.dst] = op.imm;
+                        break;
+                    case Reg_op::REG_ADD:
+                        r[op.dst] = r[op.a] + r[op.b];
+                        break;
+                    case Reg_op::REG_SUB:
+                        r[op.dst] = r[op.a] - r[op.b];
+                        break;
+                    case Reg_op::REG_MUL:
+                        r[op.dst] = r[op.a] * r[op.b];
+                        break;
+                    case Reg_op::REG_EQ:
+                        r[op.dst] = r[op.b] == r[op.a];
+                        break;
+                    case Reg_op::REG_NOT:
+                        r[op.dst] = !r[op.a];
+                        break;
+                    case Reg_op::REG_XOR:
+                        r[op.dst] = static_cast<f64>(static_cast<i64>(r[op.b]) ^ static_cast<i64>(r[op.a]));
+                        break;
+                    case Reg_op::REG_AND:
+                        r[op.dst] = static_cast<f64>(static_cast<i64>(r[op.b]) & static_cast<i64>(r[op.a]));
+                        break;
+                    case Reg_op::REG_OR:
+                        r[op.dst] = static_cast<f64>(static_cast<i64>(r[op.b]) | static_cast<i64>(r[op.a]));
+                        break;
+                }
+            }
+            const f64 cond = block.exit == Reg_exit::EXIT_BRANCH ? r[block.cond] : 0;
+            stack.resize(depth + block.net);
+            steps += block.count;
+
+            switch (block.exit) {
+                case Reg_exit::EXIT_FALLTHROUGH:
+                    vm.m_ip = block.end;
+                    break;
+                case Reg_exit::EXIT_JUMP:
+                    vm.m_ip = block.taken;
+                    break;
+                case Reg_exit::EXIT_BRANCH:
+                    vm.m_ip = static_cast<i64>(cond) != 0 ? block.taken : block.end + 1;
+                    break;
+                case Reg_exit::EXIT_STACK: {
+                    vm.m_ip = block.end;
+                    last = m_program[block.end].type;
+                    const Trap trap = vm.vm_execute_inst(m_program[block.end]);
+                    ++steps;
+                    if (trap != Trap::TRAP_OK) {
+                        return Run_result{Run_status::RUN_TRAPPED, trap, steps};
+                    }
+                    break;
+                }
+            }
+        }
+
+        if ((vm.m_ip <= ip || last == Inst_type::INST_CALL) && vm.m_interrupt.load(std::memory_order_relaxed)) {
+            vm.m_interrupt.store(false, std::memory_order_relaxed);
+            return Run_result{Run_status::RUN_YIELDED, Trap::TRAP_OK, steps, Yield_reason::YIELD_INTERRUPT};
+        }
+    }
+    return Run_result{Run_status::RUN_HALTED, Trap::TRAP_OK, steps};
+}
+
+void Reg_engine::dump(std::ostream &out) const {
+    for (const auto &block : m_blocks) {
+        if (block == nullptr) {
+            continue;
+        }
+        out << "block " << block->start << ".." << block->end << " need=" << block->need
+            << " net=" << block->net << " grow=" << block->grow << " (" << block->count << " insts -> "
+            << block->code.size() << " ops)\n";
+        for (const Reg_inst &op : block->code) {
+            out << "  " << reg_op_as_str(op.op) << " r" << op.dst;
+            if (op.op == Reg_op::REG_CONST) {
+                out << ", " << op.imm;
+            } else {
+                out << ", r" << op.a;
+                if (op.op != Reg_op::REG_MOVE && op.op != Reg_op::REG_NOT) {
+                    out << ", r" << op.b;
+                }
+            }
+            out << '\n';
+        }
+        switch (block->exit) {
+            case Reg_exit::EXIT_FALLTHROUGH:
+                out << "  -> " << block->end << '\n';
+                break;
+            case Reg_exit::EXIT_JUMP:
+                out << "  jmp " << block->taken << '\n';
+                break;
+            case Reg_exit::EXIT_BRANCH:
+                out << "  jmp_if r" << block->cond << ", " << block->taken << " else " << block->end + 1 << '\n';
+                break;
+            case Reg_exit::EXIT_STACK:
+                out << "  stack " << inst_as_str(m_program[block->end].type) << '\n';
+                break;
+        }
+    }
+}
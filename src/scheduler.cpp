@@ -0,0 +1,334 @@
+#include "../include/scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+Scheduler::Scheduler(const VM &prototype, const unsigned workers) : m_prototype(prototype) {
+    const unsigned count = workers == 0 ? 1 : workers;
+    for (unsigned i = 0; i < count; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->vm = std::make_unique<VM>(prototype.get_program());
+        if (const auto &labels = prototype.get_labels(); labels.has_value()) {
+            worker->vm->set_labels(*labels);
+        }
+        worker->vm->set_natives(prototype.get_natives());
+        worker->vm->set_heap_limit(prototype.get_heap_limit());
+        worker->vm->get_output().set_format(prototype.get_output().get_format());
+        m_workers.emplace_back(std::move(worker));
+    }
+}
+
+Scheduler::~Scheduler() = default;
+
+Run_result Scheduler::run(VM &vm, const uint64_t max_steps) {
+    m_steps_left = max_steps;
+    auto main = std::make_unique<Fiber>();
+    main->id = m_next_fiber_id++;
+    vm.vm_swap_context(main->ctx);
+    Fiber *main_fiber = main.get();
+    m_fibers.emplace(main_fiber->id, std::move(main));
+
+    m_active = 1;
+    m_workers[0]->queue.push_back(main_fiber);
+
+    // The calling thread is worker 0
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < m_workers.size(); ++w) {
+        threads.emplace_back(&Scheduler::worker_loop, this, w);
+    }
+    worker_loop(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    Fiber *shown = m_trapped != nullptr ? m_trapped : main_fiber;
+    vm.vm_swap_context(shown->ctx);
+
+    Run_status status = Run_status::RUN_HALTED;
+    Yield_reason reason = Yield_reason::YIELD_NONE;
+    if (m_trap != Trap::TRAP_OK) {
+        status = Run_status::RUN_TRAPPED;
+    } else if (!main_fiber->done) {
+        status = Run_status::RUN_YIELDED;
+        reason = m_out_of_steps ? Yield_reason::YIELD_STEPS : Yield_reason::YIELD_INTERRUPT;
+    }
+    return Run_result{status, m_trap, m_steps.load(), reason};
+}
+
+void Scheduler::interrupt() noexcept {
+    m_done.store(true);
+    for (const auto &worker : m_workers) {
+        worker->vm->vm_interrupt();
+    }
+}
+
+uint64_t Scheduler::get_trapped_fiber() const& { return m_trapped != nullptr ? m_trapped->id : 0; }
+uint64_t Scheduler::get_fiber_count() const& { return m_next_fiber_id; }
+
+void Scheduler::worker_loop(const size_t w) {
+    while (!m_done.load()) {
+        Fiber *fiber = next_fiber(w);
+        if (fiber != nullptr) {
+            run_fiber(w, fiber);
+            continue;
+        }
+        // Nothing runnable anywhere and nothing running that could wake a fiber up
+        if (m_active.load() == 0) {
+            fail(nullptr, Trap::TRAP_DEADLOCK);
+            break;
+        }
+        std::unique_lock<std::mutex> lock(m_idle_mutex);
+        m_idle_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    m_idle_cv.notify_all();
+}
+
+Scheduler::Fiber *Scheduler::next_fiber(const size_t w) {
+    {
+        Worker &own = *m_workers[w];
+        std::lock_guard<std::mutex> lock(own.queue_mutex);
+        if (!own.queue.empty()) {
+            Fiber *fiber = own.queue.front();
+            own.queue.pop_front();
+            return fiber;
+        }
+    }
+    for (size_t i = 1; i < m_workers.size(); ++i) {
+        Worker &victim = *m_workers[(w + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.queue_mutex);
+        if (!victim.queue.empty()) {
+            Fiber *fiber = victim.queue.back();
+            victim.queue.pop_back();
+            return fiber;
+        }
+    }
+    return nullptr;
+}
+
+void Scheduler::push(const size_t w, Fiber *fiber) {
+    {
+        Worker &own = *m_workers[w];
+        std::lock_guard<std::mutex> lock(own.queue_mutex);
+        own.queue.push_back(fiber);
+    }
+    m_idle_cv.notify_one();
+}
+
+void Scheduler::run_fiber(const size_t w, Fiber *fiber) {
+    VM &vm = *m_workers[w]->vm;
+    vm.vm_swap_context(fiber->ctx);
+    while (true) {
+        const uint64_t slice = claim_steps(SLICE_STEPS);
+        if (slice == 0) {
+            vm.vm_swap_context(fiber->ctx);
+            push(w, fiber);
+            out_of_steps();
+            return;
+        }
+        const Run_result result = vm.vm_run(slice);
+        m_steps.fetch_add(result.steps, std::memory_order_relaxed);
+        if (result.steps < slice) {
+            m_steps_left.fetch_add(slice - result.steps); // Hand back what the fiber did not use
+        }
+
+        if (result.status == Run_status::RUN_HALTED) {
+            vm.vm_swap_context(fiber->ctx);
+            finish(w, fiber);
+            return;
+        }
+        if (result.status == Run_status::RUN_YIELDED) {
+            vm.vm_swap_context(fiber->ctx); // Preempted or interrupted
+            push(w, fiber);
+            return;
+        }
+        const Fiber_request request = vm.get_fiber_request();
+        vm.vm_swap_context(fiber->ctx);
+        if (result.trap != Trap::TRAP_FIBER) {
+            fail(fiber, result.trap);
+            return;
+        }
+        if (!handle_request(w, fiber, request)) {
+            return;
+        }
+        vm.vm_swap_context(fiber->ctx);
+    }
+}
+
+// Called with the fiber swapped out. Returns true if the fiber can keep running.
+bool Scheduler::handle_request(const size_t w, Fiber *fiber, const Fiber_request &request) {
+    Fiber *woken = nullptr;
+    Trap trap = Trap::TRAP_OK;
+    bool keep_running = true;
+
+    switch (request.type) {
+        case Inst_type::INST_YIELD:
+            push(w, fiber);
+            return false;
+
+        case Inst_type::INST_SPAWN: {
+            auto child = std::make_unique<Fiber>();
+            child->ctx.ip = request.target;
+            child->ctx.stack.push_back(request.value);
+            woken = child.get();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            child->id = m_next_fiber_id++;
+            fiber->ctx.stack.push_back(static_cast<f64>(child->id));
+            m_fibers.emplace(child->id, std::move(child));
+            ++m_active;
+            break;
+        }
+
+        case Inst_type::INST_CHAN: {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_channels.emplace_back();
+            fiber->ctx.stack.push_back(static_cast<f64>(m_channels.size() - 1));
+            break;
+        }
+
+        case Inst_type::INST_SEND: {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (request.target < 0 || static_cast<size_t>(request.target) >= m_channels.size()) {
+                trap = Trap::TRAP_ILLEGAL_INST_ACCESS;
+                break;
+            }
+            Channel &chan = m_channels[request.target];
+            if (!chan.receivers.empty()) {
+                woken = chan.receivers.front();
+                chan.receivers.pop_front();
+                woken->ctx.stack.push_back(request.value);
+                ++m_active;
+            } else {
+                chan.values.push_back(request.value);
+            }
+            break;
+        }
+
+        case Inst_type::INST_RECV: {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (request.target < 0 || static_cast<size_t>(request.target) >= m_channels.size()) {
+                trap = Trap::TRAP_ILLEGAL_INST_ACCESS;
+                break;
+            }
+            Channel &chan = m_channels[request.target];
+            if (!chan.values.empty()) {
+                fiber->ctx.stack.push_back(chan.values.front());
+                chan.values.pop_front();
+            } else {
+                chan.receivers.push_back(fiber);
+                --m_active;
+                keep_running = false;
+            }
+            break;
+        }
+
+        case Inst_type::INST_JOIN: {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto it = m_fibers.find(static_cast<uint64_t>(request.target));
+            if (request.target < 0 || it == m_fibers.end()) {
+                trap = Trap::TRAP_ILLEGAL_INST_ACCESS;
+                break;
+            }
+            if (it->second->done) {
+                fiber->ctx.stack.push_back(it->second->result);
+            } else {
+                it->second->joiners.push_back(fiber);
+                --m_active;
+                keep_running = false;
+            }
+            break;
+        }
+
+        default:
+            trap = Trap::TRAP_ILLEGAL_INST;
+            break;
+    }
+
+    if (trap != Trap::TRAP_OK) {
+        fail(fiber, trap);
+        return false;
+    }
+    if (woken != nullptr) {
+        push(w, woken);
+    }
+    return keep_running;
+}
+
+void Scheduler::finish(const size_t w, Fiber *fiber) {
+    std::vector<Fiber *> woken;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        fiber->done = true;
+        fiber->result = fiber->ctx.stack.empty() ? 0 : fiber->ctx.stack.back();
+        for (Fiber *joiner : fiber->joiners) {
+            joiner->ctx.stack.push_back(fiber->result);
+            ++m_active;
+        }
+        woken.swap(fiber->joiners);
+
+        if (fiber->id == 0) {
+            m_done.store(true);
+        } else {
+            fiber->ctx = Exec_context{}; // Only the result outlives a finished fiber
+        }
+        --m_active;
+    }
+    for (Fiber *joiner : woken) {
+        push(w, joiner);
+    }
+}
+
+void Scheduler::fail(Fiber *fiber, const Trap trap) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_done.load()) {
+            return; // Main already halted, or another fiber trapped first
+        }
+        m_trap = trap;
+        m_trapped = fiber;
+        m_done.store(true);
+    }
+    m_idle_cv.notify_all();
+}
+
+// Takes up to `want` steps from the shared budget, 0 once it is used up
+uint64_t Scheduler::claim_steps(const uint64_t want) {
+    uint64_t left = m_steps_left.load();
+    uint64_t take{};
+    do {
+        take = std::min(want, left);
+        if (take == 0) {
+            return 0;
+        }
+    } while (!m_steps_left.compare_exchange_weak(left, left - take));
+    return take;
+}
+
+void Scheduler::out_of_steps() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_done.load()) {
+            return;
+        }
+        m_out_of_steps = true;
+        m_done.store(true);
+    }
+    m_idle_cv.notify_all();
+}
+
+bool program_uses_fibers(const VM &vm) {
+    for (size_t i = 0; i < vm.get_program_size(); ++i) {
+        switch (vm.vm_inst_at(static_cast<i64>(i)).type) {
+            case Inst_type::INST_SPAWN:
+            case Inst_type::INST_YIELD:
+            case Inst_type::INST_JOIN:
+            case Inst_type::INST_CHAN:
+            case Inst_type::INST_SEND:
+            case Inst_type::INST_RECV:
+                return true;
+            default:
+                break;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,703 @@
+#include "../include/server.hpp"
+#include "../include/bm.h"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint64_t LISTEN_KEY = 0;
+constexpr uint64_t WAKE_KEY = 1;
+constexpr size_t FRAME_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint8_t);
+
+// Cache bounds: least recently used programs are evicted past either limit
+constexpr size_t MAX_PROGRAMS = 1024;
+constexpr size_t MAX_PROGRAM_SOURCE_BYTES = 256u << 20;
+constexpr size_t MAX_WORKER_CONTEXTS = 64; // Per worker
+
+// Power-of-two latency buckets: bucket i counts requests that took less than 2^i microseconds
+class Latency_histogram final {
+private:
+    static constexpr size_t BUCKETS = 32;
+    std::array<std::atomic<uint64_t>, BUCKETS> m_buckets{};
+    std::atomic<uint64_t> m_count{};
+    std::atomic<uint64_t> m_total_us{};
+
+public:
+    void record(const uint64_t us) noexcept {
+        size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        if (bucket >= BUCKETS) {
+            bucket = BUCKETS - 1;
+        }
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_total_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    void print(std::ostream &out, const char *name) const {
+        const uint64_t count = m_count.load(std::memory_order_relaxed);
+        out << name << ": " << count << " requests";
+        if (count != 0) {
+            out << ", mean " << m_total_us.load(std::memory_order_relaxed) / count << "us";
+        }
+        out << '\n';
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            if (const uint64_t n = m_buckets[i].load(std::memory_order_relaxed); n != 0) {
+                out << "  < " << (uint64_t{1} << i) << "us\t" << n << '\n';
+            }
+        }
+    }
+};
+
+struct Job {
+    uint64_t conn_id;
+    uint8_t type;
+    std::string payload;
+    Clock::time_point received;
+};
+
+struct Completion {
+    uint64_t conn_id;
+    std::string frame;
+};
+
+struct Connection {
+    int fd;
+    std::string in{};
+    std::string out{};
+    size_t out_pos{};
+    uint32_t events{EPOLLIN};
+    uint64_t in_flight{};  // Requests queued or running for this client
+    bool read_closed{};    // Client shut down its write side, finish in-flight work then close
+};
+
+// Bounds-checked reader over a request payload
+class Reader final {
+private:
+    const std::string &m_data;
+    size_t m_pos{};
+
+public:
+    explicit Reader(const std::string &data) : m_data(data) {}
+
+    template <typename T>
+    bool get(T &value) {
+        if (m_data.size() - m_pos < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, m_data.data() + m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return true;
+    }
+
+    std::string rest() const { return m_data.substr(m_pos); }
+};
+
+template <typename T>
+void put(std::string &out, const T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+std::string make_frame(const uint8_t type, const std::string &payload) {
+    std::string frame;
+    frame.reserve(FRAME_HEADER_SIZE + payload.size());
+    put<uint32_t>(frame, static_cast<uint32_t>(payload.size()));
+    put<uint8_t>(frame, type | BM_FRAME_RESPONSE);
+    frame += payload;
+    return frame;
+}
+
+// Map with least-recently-used eviction; find() counts as a use
+template <typename Key, typename Value>
+class Lru_map final {
+private:
+    using Entry = std::pair<Key, Value>;
+    std::list<Entry> m_order{}; // Most recently used first
+    std::unordered_map<Key, typename std::list<Entry>::iterator> m_index{};
+
+public:
+    Value *find(const Key &key) {
+        const auto it = m_index.find(key);
+        if (it == m_index.end()) {
+            return nullptr;
+        }
+        m_order.splice(m_order.begin(), m_order, it->second);
+        return &it->second->second;
+    }
+
+    // The key must not be present
+    Value &insert(const Key &key, Value value) {
+        m_order.emplace_front(key, std::move(value));
+        m_index.emplace(key, m_order.begin());
+        return m_order.front().second;
+    }
+
+    void erase(const Key &key) {
+        if (const auto it = m_index.find(key); it != m_index.end()) {
+            m_order.erase(it->second);
+            m_index.erase(it);
+        }
+    }
+
+    const Entry &oldest() const { return m_order.back(); }
+    void pop_oldest() {
+        m_index.erase(m_order.back().first);
+        m_order.pop_back();
+    }
+    size_t size() const { return m_index.size(); }
+};
+
+using Program_ptr = std::shared_ptr<const bm_program>;
+
+struct Cached_program {
+    Program_ptr program;
+    const std::string *source; // Key in Server::m_program_ids
+};
+
+// A worker's reusable context, which keeps its program alive after eviction
+struct Worker_context {
+    Program_ptr program;
+    std::unique_ptr<bm_context, void (*)(bm_context *)> ctx;
+};
+
+class Server final {
+private:
+    std::string m_path;
+    const volatile std::sig_atomic_t &m_stop;
+
+    int m_listen_fd{-1};
+    int m_epoll_fd{-1};
+    int m_wake_fd{-1};
+
+    std::unordered_map<uint64_t, Connection> m_conns{};
+    uint64_t m_next_conn_id{WAKE_KEY + 1};
+
+    std::mutex m_jobs_mutex{};
+    std::condition_variable m_jobs_cv{};
+    std::deque<Job> m_jobs{};
+    bool m_shutdown{};
+
+    std::mutex m_done_mutex{};
+    std::vector<Completion> m_done{};
+
+    // Ids are handed out from a counter and never reused, so an id always names the same source
+    std::mutex m_programs_mutex{};
+    Lru_map<uint64_t, Cached_program> m_programs{};
+    std::unordered_map<std::string, uint64_t> m_program_ids{}; // Source to id, so identical loads share one program
+    size_t m_program_bytes{};
+    uint64_t m_next_program_id{1};
+
+    Program_ptr find_program(uint64_t);
+
+    Latency_histogram m_load_latency{};
+    Latency_histogram m_exec_latency{};
+
+    std::vector<std::thread> m_workers{};
+
+    void worker();
+    std::string handle_load(const std::string &);
+    std::string handle_exec(const std::string &, Lru_map<uint64_t, Worker_context> &);
+    std::string handle_stats(const std::string &);
+
+    void accept_clients();
+    void read_client(uint64_t);
+    void flush_client(uint64_t);
+    void update_events(uint64_t);
+    void close_client(uint64_t);
+    void drain_completions();
+
+public:
+    Server(std::string path, const volatile std::sig_atomic_t &stop);
+    ~Server();
+
+    bool open();
+    void run(unsigned workers);
+};
+
+Server::Server(std::string path, const volatile std::sig_atomic_t &stop) : m_path(std::move(path)), m_stop(stop) {}
+
+Server::~Server() {
+    for (auto &[id, conn] : m_conns) {
+        ::close(conn.fd);
+    }
+    if (m_wake_fd >= 0) {
+        ::close(m_wake_fd);
+    }
+    if (m_epoll_fd >= 0) {
+        ::close(m_epoll_fd);
+    }
+    if (m_listen_fd >= 0) {
+        ::close(m_listen_fd);
+        ::unlink(m_path.c_str());
+    }
+}
+
+bool Server::open() {
+    sockaddr_un addr{};
+    if (m_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Error: socket path is too long: " << m_path << '\n';
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, m_path.c_str(), m_path.size() + 1);
+
+    m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0) {
+        std::cerr << "Error: socket(): " << std::strerror(errno) << '\n';
+        return false;
+    }
+    ::unlink(m_path.c_str());
+    if (::bind(m_listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(m_listen_fd, SOMAXCONN) < 0) {
+        std::cerr << "Error: cannot listen on " << m_path << ": " << std::strerror(errno) << '\n';
+        return false;
+    }
+
+    m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    m_wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epoll_fd < 0 || m_wake_fd < 0) {
+        std::cerr << "Error: epoll/eventfd setup failed: " << std::strerror(errno) << '\n';
+        return false;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_KEY;
+    ::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev);
+    ev.data.u64 = WAKE_KEY;
+    ::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+    return true;
+}
+
+void Server::run(const unsigned workers) {
+    for (unsigned i = 0; i < workers; ++i) {
+        m_workers.emplace_back(&Server::worker, this);
+    }
+
+    std::array<epoll_event, 64> events{};
+    while (!m_stop) {
+        const int n = ::epoll_wait(m_epoll_fd, events.data(), static_cast<int>(events.size()), 500);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error: epoll_wait(): " << std::strerror(errno) << '\n';
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            const uint64_t key = events[i].data.u64;
+            const uint32_t flags = events[i].events;
+            if (key == LISTEN_KEY) {
+                accept_clients();
+            } else if (key == WAKE_KEY) {
+                uint64_t count{};
+                while (::read(m_wake_fd, &count, sizeof(count)) > 0) {}
+                drain_completions();
+            } else {
+                if (flags & (EPOLLERR | EPOLLHUP)) {
+                    close_client(key); // Both directions are gone, nobody is left to answer
+                    continue;
+                }
+                if ((flags & EPOLLIN) && m_conns.count(key) != 0) {
+                    read_client(key);
+                }
+                if ((flags & EPOLLOUT) && m_conns.count(key) != 0) {
+                    flush_client(key);
+                }
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        m_shutdown = true;
+    }
+    m_jobs_cv.notify_all();
+    for (auto &t : m_workers) {
+        t.join();
+    }
+
+    m_load_latency.print(std::cerr, "load");
+    m_exec_latency.print(std::cerr, "exec");
+}
+
+void Server::accept_clients() {
+    while (true) {
+        const int fd = ::accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return; // EAGAIN, or a transient error for this one client
+        }
+        const uint64_t id = m_next_conn_id++;
+        m_conns.emplace(id, Connection{fd});
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void Server::read_client(const uint64_t id) {
+    const auto it = m_conns.find(id);
+    if (it == m_conns.end()) {
+        return; // Closed earlier in the same epoll batch
+    }
+    Connection &conn = it->second;
+    char buf[64 * 1024];
+    while (true) {
+        const ssize_t n = ::read(conn.fd, buf, sizeof(buf));
+        if (n > 0) {
+            conn.in.append(buf, static_cast<size_t>(n));
+        } else if (n == 0) {
+            conn.read_closed = true;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            close_client(id);
+            return;
+        }
+    }
+
+    // Every complete frame becomes a job; they are queued in one batch
+    std::vector<Job> jobs;
+    size_t pos = 0;
+    const auto now = Clock::now();
+    while (conn.in.size() - pos >= FRAME_HEADER_SIZE) {
+        uint32_t len{};
+        uint8_t type{};
+        std::memcpy(&len, conn.in.data() + pos, sizeof(len));
+        std::memcpy(&type, conn.in.data() + pos + sizeof(len), sizeof(type));
+        if (len > BM_MAX_FRAME_SIZE || (type != BM_FRAME_LOAD && type != BM_FRAME_EXEC && type != BM_FRAME_STATS)) {
+            close_client(id); // Malformed stream, there is no way to resynchronize
+            return;
+        }
+        if (conn.in.size() - pos - FRAME_HEADER_SIZE < len) {
+            break;
+        }
+        jobs.push_back(Job{id, type, conn.in.substr(pos + FRAME_HEADER_SIZE, len), now});
+        pos += FRAME_HEADER_SIZE + len;
+    }
+    conn.in.erase(0, pos);
+    conn.in_flight += jobs.size();
+
+    if (!jobs.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(m_jobs_mutex);
+            for (auto &job : jobs) {
+                m_jobs.push_back(std::move(job));
+            }
+        }
+        if (jobs.size() == 1) {
+            m_jobs_cv.notify_one();
+        } else {
+            m_jobs_cv.notify_all();
+        }
+    }
+
+    update_events(id);
+}
+
+void Server::flush_client(const uint64_t id) {
+    const auto it = m_conns.find(id);
+    if (it == m_conns.end()) {
+        return; // Closed earlier in the same epoll batch
+    }
+    Connection &conn = it->second;
+    while (conn.out_pos < conn.out.size()) {
+        const ssize_t n = ::send(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+        if (n > 0) {
+            conn.out_pos += static_cast<size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            close_client(id);
+            return;
+        }
+    }
+    if (conn.out_pos == conn.out.size()) {
+        conn.out.clear();
+        conn.out_pos = 0;
+    }
+    update_events(id);
+}
+
+// Re-arms epoll for what the client is still waiting on, or closes it once it is done
+void Server::update_events(const uint64_t id) {
+    const auto it = m_conns.find(id);
+    if (it == m_conns.end()) {
+        return; // Closed earlier in the same epoll batch
+    }
+    Connection &conn = it->second;
+    const bool pending = !conn.out.empty();
+    if (conn.read_closed && conn.in_flight == 0 && !pending) {
+        close_client(id);
+        return;
+    }
+
+    const uint32_t events = (conn.read_closed ? 0u : static_cast<uint32_t>(EPOLLIN)) |
+                            (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    if (events != conn.events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = id;
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.events = events;
+    }
+}
+
+void Server::close_client(const uint64_t id) {
+    if (const auto it = m_conns.find(id); it != m_conns.end()) {
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        ::close(it->second.fd);
+        m_conns.erase(it);
+    }
+}
+
+void Server::drain_completions() {
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(m_done_mutex);
+        done.swap(m_done);
+    }
+
+    // Append everything first so each client gets a single write for the batch
+    std::vector<uint64_t> touched;
+    for (auto &c : done) {
+        const auto it = m_conns.find(c.conn_id);
+        if (it == m_conns.end()) {
+            continue; // Client went away while its request was running
+        }
+        if (it->second.out.empty()) {
+            touched.push_back(c.conn_id);
+        }
+        it->second.out += c.frame;
+        --it->second.in_flight;
+    }
+    for (const uint64_t id : touched) {
+        if (m_conns.count(id) != 0) {
+            flush_client(id);
+        }
+    }
+}
+
+void Server::worker() {
+    Lru_map<uint64_t, Worker_context> contexts; // Reused per program to avoid copying it per request
+
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_jobs_mutex);
+            m_jobs_cv.wait(lock, [this] { return m_shutdown || !m_jobs.empty(); });
+            if (m_shutdown) {
+                break;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+
+        std::string payload;
+        Latency_histogram *latency = nullptr;
+        switch (job.type) {
+            case BM_FRAME_LOAD:
+                payload = handle_load(job.payload);
+                latency = &m_load_latency;
+                break;
+            case BM_FRAME_EXEC:
+                payload = handle_exec(job.payload, contexts);
+                latency = &m_exec_latency;
+                break;
+            default:
+                payload = handle_stats(job.payload);
+                break;
+        }
+
+        if (latency != nullptr) {
+            const auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - job.received).count();
+            latency->record(static_cast<uint64_t>(us));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_done_mutex);
+            m_done.push_back(Completion{job.conn_id, make_frame(job.type, payload)});
+        }
+        const uint64_t one = 1;
+        (void)::write(m_wake_fd, &one, sizeof(one));
+    }
+}
+
+std::string Server::handle_load(const std::string &request) {
+    Reader in(request);
+    uint64_t tag{};
+    std::string out;
+    if (!in.get(tag)) {
+        put<uint64_t>(out, 0);
+        put<uint32_t>(out, BM_ERR_INVALID_ARG);
+        put<uint64_t>(out, 0);
+        return out;
+    }
+
+    const std::string source = in.rest();
+    uint64_t id = 0;
+    bm_status status = BM_OK;
+    char err[256] = {};
+
+    {
+        std::lock_guard<std::mutex> lock(m_programs_mutex);
+        if (const auto it = m_program_ids.find(source); it != m_program_ids.end()) {
+            id = it->second;
+            m_programs.find(id); // Counts as a use
+        }
+    }
+    if (id == 0) {
+        bm_program *assembled = nullptr;
+        status = bm_program_assemble(source.data(), source.size(), &assembled, err, sizeof(err));
+        if (status == BM_OK) {
+            Program_ptr program(assembled, bm_program_free);
+            std::lock_guard<std::mutex> lock(m_programs_mutex);
+            const auto [it, inserted] = m_program_ids.emplace(source, m_next_program_id);
+            id = it->second;
+            if (inserted) { // Otherwise an identical load won the race and its program is kept
+                ++m_next_program_id;
+                m_programs.insert(id, Cached_program{std::move(program), &it->first});
+                m_program_bytes += source.size();
+                while (m_programs.size() > 1 &&
+                       (m_programs.size() > MAX_PROGRAMS || m_program_bytes > MAX_PROGRAM_SOURCE_BYTES)) {
+                    const std::string *evicted = m_programs.oldest().second.source;
+                    m_program_bytes -= evicted->size();
+                    m_programs.pop_oldest();
+                    m_program_ids.erase(*evicted);
+                }
+            }
+        }
+    }
+
+    put<uint64_t>(out, tag);
+    put<uint32_t>(out, status);
+    put<uint64_t>(out, status == BM_OK ? id : 0);
+    out += err;
+    return out;
+}
+
+Program_ptr Server::find_program(const uint64_t id) {
+    std::lock_guard<std::mutex> lock(m_programs_mutex);
+    const Cached_program *cached = m_programs.find(id);
+    return cached != nullptr ? cached->program : nullptr;
+}
+
+std::string Server::handle_exec(const std::string &request, Lru_map<uint64_t, Worker_context> &contexts) {
+    Reader in(request);
+    uint64_t tag{}, id{}, budget{};
+    uint32_t n_inputs{};
+    std::string out;
+
+    const auto reply = [&](const uint64_t t, const bm_status status, const bm_context *ctx, const uint64_t steps) {
+        put<uint64_t>(out, t);
+        put<uint32_t>(out, status);
+        put<uint32_t>(out, ctx != nullptr ? bm_context_trap(ctx) : BM_TRAP_OK);
+        put<uint64_t>(out, steps);
+        const size_t size = ctx != nullptr ? bm_stack_size(ctx) : 0;
+        put<uint32_t>(out, static_cast<uint32_t>(size));
+        for (size_t i = 0; i < size; ++i) {
+            double value{};
+            bm_stack_get(ctx, i, &value);
+            put<double>(out, value);
+        }
+        return out;
+    };
+
+    if (!in.get(tag) || !in.get(id) || !in.get(budget) || !in.get(n_inputs)) {
+        return reply(tag, BM_ERR_INVALID_ARG, nullptr, 0);
+    }
+
+    // An evicted id fails even if this worker still has a context for it
+    const Program_ptr program = find_program(id);
+    if (program == nullptr) {
+        contexts.erase(id);
+        return reply(tag, BM_ERR_INVALID_ARG, nullptr, 0);
+    }
+
+    bm_context *ctx = nullptr;
+    if (Worker_context *cached = contexts.find(id); cached != nullptr) {
+        ctx = cached->ctx.get();
+        bm_context_reset(ctx);
+    } else {
+        if (const bm_status status = bm_context_create(program.get(), &ctx); status != BM_OK) {
+            return reply(tag, status, nullptr, 0);
+        }
+        bm_set_output(ctx, nullptr, nullptr); // print_debug from clients is discarded
+        contexts.insert(id, Worker_context{program, {ctx, bm_context_free}});
+        if (contexts.size() > MAX_WORKER_CONTEXTS) {
+            contexts.pop_oldest();
+        }
+    }
+
+    for (uint32_t i = 0; i < n_inputs; ++i) {
+        double value{};
+        if (!in.get(value)) {
+            bm_context_reset(ctx);
+            return reply(tag, BM_ERR_INVALID_ARG, nullptr, 0);
+        }
+        bm_push(ctx, value);
+    }
+
+    uint64_t steps{};
+    const bm_status status = bm_run(ctx, budget, &steps);
+    return reply(tag, status, ctx, steps);
+}
+
+std::string Server::handle_stats(const std::string &request) {
+    Reader in(request);
+    uint64_t tag{};
+    in.get(tag);
+
+    std::ostringstream text;
+    m_load_latency.print(text, "load");
+    m_exec_latency.print(text, "exec");
+
+    std::string out;
+    put<uint64_t>(out, tag);
+    out += text.str();
+    return out;
+}
+
+} // namespace
+
+bool bm_serve(const std::string &socket_path, unsigned workers, const volatile std::sig_atomic_t &stop) {
+    if (workers == 0) {
+        workers = 1;
+    }
+    Server server(socket_path, stop);
+    if (!server.open()) {
+        return false;
+    }
+    std::cerr << "Serving on " << socket_path << " with " << workers << " workers\n";
+    server.run(workers);
+    return true;
+}
@@ -10,6 +10,9 @@
 #include <fstream>
 #include <cassert>
 #include <limits>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 
 const std::string trap_as_str(Trap trap) noexcept {
     switch (trap) {
@@ -25,9 +28,20 @@ const std::string trap_as_str(Trap trap) noexcept {
         return "TRAP_DIV_BY_ZERO";
     case Trap::TRAP_ILLEGAL_INST_ACCESS:
         return "TRAP_ILLEGAL_INST ACCESS";
+    case Trap::TRAP_BREAKPOINT:
+        return "TRAP_BREAKPOINT";
+    case Trap::TRAP_FIBER:
+        return "TRAP_FIBER";
+    case Trap::TRAP_DEADLOCK:
+        return "TRAP_DEADLOCK";
+    case Trap::TRAP_ILLEGAL_MEMORY_ACCESS:
+        return "TRAP_ILLEGAL_MEMORY_ACCESS";
+    case Trap::TRAP_OUT_OF_MEMORY:
+        return "TRAP_OUT_OF_MEMORY";
     default:
         assert(0 && "trap_as_str() Unreachable");
     }
+    return "TRAP_UNKNOWN";
 }
 
 const std::string inst_as_str(const Inst_type &type) noexcept {
@@ -38,6 +52,8 @@ const std::string inst_as_str(const Inst_type &type) noexcept {
             return "INST_PUSH";
         case Inst_type::INST_DUP:
             return "INST_DUP";
+        case Inst_type::INST_DROP:
+            return "INST_DROP";
         case Inst_type::INST_SWAP:
             return "INST_SWAP";
         case Inst_type::INST_PLUS:
@@ -74,6 +90,50 @@ const std::string inst_as_str(const Inst_type &type) noexcept {
             return "INST_SHR";
         case Inst_type::INST_PRINT_DEBUG:
             return "INST_TYPE_PRINT_DEBUG";
+        case Inst_type::INST_BREAK:
+            return "INST_BREAK";
+        case Inst_type::INST_SPAWN:
+            return "INST_SPAWN";
+        case Inst_type::INST_YIELD:
+            return "INST_YIELD";
+        case Inst_type::INST_JOIN:
+            return "INST_JOIN";
+        case Inst_type::INST_CHAN:
+            return "INST_CHAN";
+        case Inst_type::INST_SEND:
+            return "INST_SEND";
+        case Inst_type::INST_RECV:
+            return "INST_RECV";
+        case Inst_type::INST_NATIVE:
+            return "INST_NATIVE";
+        case Inst_type::INST_ALLOC:
+            return "INST_ALLOC";
+        case Inst_type::INST_LOAD_I64:
+            return "INST_LOAD_I64";
+        case Inst_type::INST_LOAD_F64:
+            return "INST_LOAD_F64";
+        case Inst_type::INST_LOAD_U8:
+            return "INST_LOAD_U8";
+        case Inst_type::INST_STORE_I64:
+            return "INST_STORE_I64";
+        case Inst_type::INST_STORE_F64:
+            return "INST_STORE_F64";
+        case Inst_type::INST_STORE_U8:
+            return "INST_STORE_U8";
+        case Inst_type::INST_MEMCPY:
+            return "INST_MEMCPY";
+        case Inst_type::INST_MEMSET:
+            return "INST_MEMSET";
+        case Inst_type::INST_MEMCMP:
+            return "INST_MEMCMP";
+        case Inst_type::INST_ENTER:
+            return "INST_ENTER";
+        case Inst_type::INST_LOAD_LOCAL:
+            return "INST_LOAD_LOCAL";
+        case Inst_type::INST_STORE_LOCAL:
+            return "INST_STORE_LOCAL";
+        case Inst_type::INST_TCALL:
+            return "INST_TCALL";
         default:
             assert(0 && "inst_as_str() Unreachable");
             return "Unreachable";
@@ -94,6 +154,7 @@ Instruction inst_jmp(i64 addr) noexcept { return Instruction{.type = Inst_type::
 Instruction inst_jmp(const std::string &label) noexcept { return Instruction{.type = Inst_type::INST_JMP, .operand = label}; }
 Instruction inst_jmp_if(const std::string &operand) noexcept { return Instruction{.type = Inst_type::INST_JMP_IF, .operand = operand}; }
 Instruction inst_halt() noexcept { return Instruction{.type = Inst_type::INST_HALT}; }
+Instruction inst_print_debug() noexcept { return Instruction{.type = Inst_type::INST_PRINT_DEBUG}; }
 Instruction inst_not() noexcept { return Instruction{.type = Inst_type::INST_NOT}; }
 Instruction inst_ret() noexcept { return Instruction{.type = Inst_type::INST_RET}; }
 Instruction inst_call(const std::string &f) noexcept { return Instruction{.type = Inst_type::INST_CALL, .operand = f};}
@@ -102,16 +163,41 @@ Instruction inst_and() noexcept { return Instruction{.type = Inst_type::INST_AND
 Instruction inst_or() noexcept { return Instruction{.type = Inst_type::INST_OR}; }
 Instruction inst_shl(const i64 index, const i64 shift_amount) noexcept { return Instruction{.type = Inst_type::INST_SHL, .operand = std::make_pair(index, shift_amount)}; }
 Instruction inst_shr(const i64 index, const i64 shift_amount) noexcept { return Instruction{.type = Inst_type::INST_SHR, .operand = std::make_pair(index, shift_amount)}; }
+Instruction inst_break() noexcept { return Instruction{.type = Inst_type::INST_BREAK}; }
+Instruction inst_spawn(const std::string &label) noexcept { return Instruction{.type = Inst_type::INST_SPAWN, .operand = label}; }
+Instruction inst_yield() noexcept { return Instruction{.type = Inst_type::INST_YIELD}; }
+Instruction inst_join() noexcept { return Instruction{.type = Inst_type::INST_JOIN}; }
+Instruction inst_chan() noexcept { return Instruction{.type = Inst_type::INST_CHAN}; }
+Instruction inst_send() noexcept { return Instruction{.type = Inst_type::INST_SEND}; }
+Instruction inst_recv() noexcept { return Instruction{.type = Inst_type::INST_RECV}; }
+Instruction inst_native(const i64 index) noexcept { return Instruction{.type = Inst_type::INST_NATIVE, .operand = index}; }
+Instruction inst_alloc() noexcept { return Instruction{.type = Inst_type::INST_ALLOC}; }
+Instruction inst_load_i64() noexcept { return Instruction{.type = Inst_type::INST_LOAD_I64}; }
+Instruction inst_load_f64() noexcept { return Instruction{.type = Inst_type::INST_LOAD_F64}; }
+Instruction inst_load_u8() noexcept { return Instruction{.type = Inst_type::INST_LOAD_U8}; }
+Instruction inst_store_i64() noexcept { return Instruction{.type = Inst_type::INST_STORE_I64}; }
+Instruction inst_store_f64() noexcept { return Instruction{.type = Inst_type::INST_STORE_F64}; }
+Instruction inst_store_u8() noexcept { return Instruction{.type = Inst_type::INST_STORE_U8}; }
+Instruction inst_memcpy() noexcept { return Instruction{.type = Inst_type::INST_MEMCPY}; }
+Instruction inst_memset() noexcept { return Instruction{.type = Inst_type::INST_MEMSET}; }
+Instruction inst_memcmp() noexcept { return Instruction{.type = Inst_type::INST_MEMCMP}; }
+Instruction inst_enter(const i64 args, const i64 locals) noexcept {
+    return Instruction{.type = Inst_type::INST_ENTER, .operand = std::make_pair(args, locals)};
+}
+Instruction inst_load_local(const i64 index) noexcept { return Instruction{.type = Inst_type::INST_LOAD_LOCAL, .operand = index}; }
+Instruction inst_store_local(const i64 index) noexcept { return Instruction{.type = Inst_type::INST_STORE_LOCAL, .operand = index}; }
+Instruction inst_tcall(const std::string &f) noexcept { return Instruction{.type = Inst_type::INST_TCALL, .operand = f}; }
 
 VM::VM() :m_ip(0), m_halt(0) {}
 
 VM::VM(const std::vector<Instruction> &program) : m_program(program) {}
 
 void VM::set_stack(const std::vector<f64> &stack) & { m_stack = stack; }
-const std::vector<f64> VM::get_stack() const& { return m_stack; }
+const std::vector<f64> &VM::get_stack() const& { return m_stack; }
 
 void VM::set_program(const std::vector<Instruction>& prog) & { m_program = prog; }
 const std::vector<Instruction> VM::get_program() const& { return m_program; }
+size_t VM::get_program_size() const& { return m_program.size(); }
 
 void VM::set_ip(const i64 val) & { m_ip = val; }
 i64 VM::get_ip() const& { return m_ip; }
@@ -126,15 +212,88 @@ i64 VM::get_label_loc(const std::string &l) & {
     return((*m_labels)[l]);
 }
 
+const std::string &VM::get_error() const& { return m_error; }
+
+void VM::set_labels(const std::unordered_map<std::string, int> &labels) & { m_labels = labels; }
+const std::optional<std::unordered_map<std::string, int>> &VM::get_labels() const& { return m_labels; }
+const std::vector<i64> &VM::get_call_stack() const& { return m_call_stack; }
+const std::vector<Frame> &VM::get_frames() const& { return m_frames; }
+
+const Fiber_request &VM::get_fiber_request() const& { return m_fiber_request; }
+
+void VM::set_heap_limit(const size_t limit) & { m_heap_limit = limit; }
+size_t VM::get_heap_limit() const& { return m_heap_limit; }
+void VM::vm_reserve_heap(const size_t size) { m_heap.reserve(std::min(size, m_heap_limit)); }
+const std::vector<uint8_t> &VM::get_heap() const& { return m_heap; }
+
+bool VM::vm_heap_range(const f64 addr, const f64 len, size_t &offset) const {
+    // Checked as doubles first: NaN, negative or huge values must not reach the integer casts
+    if (!(addr >= 0 && len >= 0 && addr + len <= static_cast<f64>(m_heap.size()))) {
+        return false;
+    }
+    offset = static_cast<size_t>(addr);
+    return offset + static_cast<size_t>(len) <= m_heap.size();
+}
+
+Output &VM::get_output() & { return m_output; }
+const Output &VM::get_output() const& { return m_output; }
+void VM::vm_flush_output() { m_output.flush(); }
+
+i64 VM::vm_register_native(const Native &native) {
+    for (size_t i = 0; i < m_natives.size(); ++i) {
+        if (m_natives[i].name == native.name) {
+            m_natives[i] = native;
+            return static_cast<i64>(i);
+        }
+    }
+    m_natives.emplace_back(native);
+    return static_cast<i64>(m_natives.size() - 1);
+}
+
+void VM::set_natives(const std::vector<Native> &natives) & { m_natives = natives; }
+const std::vector<Native> &VM::get_natives() const& { return m_natives; }
+
+const Instruction &VM::vm_inst_at(const i64 ip) const {
+    return m_program.at(ip);
+}
+
+void VM::vm_patch_inst(const i64 ip, const Instruction &inst) {
+    m_program.at(ip) = inst;
+}
+
+void VM::vm_reset(const i64 entry) {
+    m_stack.clear();
+    m_call_stack.clear();
+    m_frames.clear();
+    m_trace.clear();
+    m_heap.clear(); // Keeps the arena's capacity for the next run
+    m_ip = entry;
+    m_halt = 0;
+    m_interrupt.store(false, std::memory_order_relaxed); // Meant for the run that already returned
+}
+
 void VM::vm_push_inst(const Instruction &inst) {
     m_program.emplace_back(inst);
 }
 
+void VM::vm_push_value(const f64 value) {
+    m_stack.emplace_back(value);
+}
+
+Trap VM::vm_step() {
+    if (m_ip < 0 || static_cast<size_t>(m_ip) >= m_program.size()) {
+        return Trap::TRAP_ILLEGAL_INST_ACCESS;
+    }
+    return vm_execute_inst(m_program[m_ip]);
+}
+
 Trap VM::vm_execute_inst(const Instruction &inst) {
     if (m_ip < 0) {
         return Trap::TRAP_ILLEGAL_INST_ACCESS;
     }
-    
+
+    m_trace.record(m_ip, inst.type, m_stack.empty() ? 0.0 : m_stack.back());
+
     switch (inst.type) {
         case Inst_type::INST_NOP:
             m_ip += 1;
@@ -173,16 +332,21 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
         }
 
         case Inst_type::INST_DROP:
+            if (m_stack.empty()) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
             m_stack.resize(m_stack.size() - 1);
             m_ip += 1;
             break;
 
         case Inst_type::INST_SWAP: {
-            if (m_stack.size() < 2) {
-                std::cout << "SWAP";
-                return Trap::TRAP_STACK_UNDERFLOW;
+            if (!std::holds_alternative<i64>(inst.operand) || std::get<i64>(inst.operand) < 0) {
+                return Trap::TRAP_ILLEGAL_INST;
             }
             const i64 oper = std::get<i64>(inst.operand);
+            if (m_stack.size() < 2 || m_stack.size() <= static_cast<size_t>(oper)) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
             std::swap(m_stack.at(m_stack.size() - 1),
                       m_stack.at(m_stack.size() - 1 - oper));
             m_ip += 1;
@@ -190,7 +354,6 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
         }
         case Inst_type::INST_PLUS:
             if (m_stack.size() < 2) {
-                std::cout << "PLUS";
                 return Trap::TRAP_STACK_UNDERFLOW;
             } else {
                 m_stack.at(m_stack.size() - 2) += m_stack.at(m_stack.size() - 1);
@@ -201,7 +364,6 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
 
         case Inst_type::INST_MINUS:
             if (m_stack.size() < 2) {
-                std::cout << "MINUS!";
                 return Trap::TRAP_STACK_UNDERFLOW;
             } else {
                 m_stack.at(m_stack.size() - 2) -= m_stack.at(m_stack.size() - 1);
@@ -288,6 +450,9 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
             if (m_call_stack.empty()) {
                 return Trap::TRAP_STACK_UNDERFLOW;  // No saved instruction pointer
             }
+            if (!vm_pop_frame()) {
+                return Trap::TRAP_STACK_UNDERFLOW; // The function dropped part of its frame
+            }
             m_ip = m_call_stack.back();  // Restore the instruction pointer
             m_call_stack.pop_back();
             break;
@@ -305,11 +470,72 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
             }
             break;
         }
+        case Inst_type::INST_TCALL: {
+            if (!std::holds_alternative<std::string>(inst.operand)) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            const auto &label = std::get<std::string>(inst.operand);
+            if (!m_labels.has_value() || m_labels->find(label) == m_labels->end()) {
+                return Trap::TRAP_ILLEGAL_INST_ACCESS;
+            }
+            // The callee's arguments are on top of the frame and slide down with the rest
+            if (!vm_pop_frame()) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            m_ip = (*m_labels)[label];
+            break;
+        }
+
+        case Inst_type::INST_ENTER: {
+            if (!std::holds_alternative<std::pair<i64, i64>>(inst.operand)) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            const auto [args, locals] = std::get<std::pair<i64, i64>>(inst.operand);
+            if (args < 0 || locals < 0) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            if (m_stack.size() < static_cast<size_t>(args)) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const size_t base = m_stack.size() - static_cast<size_t>(args);
+            m_stack.resize(m_stack.size() + static_cast<size_t>(locals));
+            m_frames.emplace_back(Frame{base, static_cast<size_t>(args + locals), m_call_stack.size()});
+            m_ip += 1;
+            break;
+        }
+
+        case Inst_type::INST_LOAD_LOCAL:
+        case Inst_type::INST_STORE_LOCAL: {
+            if (!std::holds_alternative<i64>(inst.operand)) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            const i64 index = std::get<i64>(inst.operand);
+            if (m_frames.empty() || m_frames.back().depth != m_call_stack.size() || index < 0 ||
+                static_cast<size_t>(index) >= m_frames.back().size) {
+                return Trap::TRAP_ILLEGAL_INST; // No frame in this function, or not one of its slots
+            }
+            const size_t slot = m_frames.back().base + static_cast<size_t>(index);
+            if (inst.type == Inst_type::INST_LOAD_LOCAL) {
+                if (slot >= m_stack.size()) {
+                    return Trap::TRAP_STACK_UNDERFLOW;
+                }
+                m_stack.emplace_back(m_stack[slot]);
+            } else {
+                if (slot + 1 >= m_stack.size()) {
+                    return Trap::TRAP_STACK_UNDERFLOW; // Needs the slot and a value above it
+                }
+                m_stack[slot] = m_stack.back();
+                m_stack.pop_back();
+            }
+            m_ip += 1;
+            break;
+        }
+
         case Inst_type::INST_PRINT_DEBUG:
             if (m_stack.empty()) {
                 return Trap::TRAP_STACK_UNDERFLOW;
             } else {
-                std::cout << m_stack.at(m_stack.size() - 1) << '\n';
+                m_output.write_value(m_stack.back());
                 m_stack.pop_back();
                 m_ip += 1;
             }
@@ -319,6 +545,179 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
             m_halt = 1;
             break;
 
+        case Inst_type::INST_BREAK:
+            return Trap::TRAP_BREAKPOINT; // ip stays on the breakpoint so the debugger can resume it
+
+        // Fiber instructions pop their operands and hand over to the scheduler
+        case Inst_type::INST_SPAWN: {
+            if (!std::holds_alternative<std::string>(inst.operand)) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            if (m_stack.empty()) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const auto &label = std::get<std::string>(inst.operand);
+            if (!m_labels.has_value() || m_labels->find(label) == m_labels->end()) {
+                return Trap::TRAP_ILLEGAL_INST_ACCESS;
+            }
+            m_fiber_request = Fiber_request{inst.type, (*m_labels)[label], m_stack.back()};
+            m_stack.pop_back();
+            m_ip += 1;
+            return Trap::TRAP_FIBER;
+        }
+
+        case Inst_type::INST_YIELD:
+        case Inst_type::INST_CHAN:
+            m_fiber_request = Fiber_request{inst.type, 0, 0};
+            m_ip += 1;
+            return Trap::TRAP_FIBER;
+
+        case Inst_type::INST_JOIN:
+        case Inst_type::INST_RECV:
+            if (m_stack.empty()) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            m_fiber_request = Fiber_request{inst.type, static_cast<i64>(m_stack.back()), 0};
+            m_stack.pop_back();
+            m_ip += 1;
+            return Trap::TRAP_FIBER;
+
+        case Inst_type::INST_SEND: {
+            if (m_stack.size() < 2) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const f64 value = m_stack.back();
+            m_stack.pop_back();
+            m_fiber_request = Fiber_request{inst.type, static_cast<i64>(m_stack.back()), value};
+            m_stack.pop_back();
+            m_ip += 1;
+            return Trap::TRAP_FIBER;
+        }
+
+        case Inst_type::INST_NATIVE: {
+            if (!std::holds_alternative<i64>(inst.operand)) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            const i64 index = std::get<i64>(inst.operand);
+            if (index < 0 || static_cast<size_t>(index) >= m_natives.size()) {
+                return Trap::TRAP_ILLEGAL_INST;
+            }
+            const Native &native = m_natives[index];
+            if (m_stack.size() < native.arity) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            // Arguments stay in place and results are written just above them, then slid down
+            const size_t base = m_stack.size() - native.arity;
+            m_stack.resize(m_stack.size() + native.results);
+            f64 *args = m_stack.data() + base;
+            if (const Trap trap = native.fn(args, args + native.arity, native.user); trap != Trap::TRAP_OK) {
+                m_stack.resize(base + native.arity);
+                return trap;
+            }
+            std::copy(args + native.arity, args + native.arity + native.results, args);
+            m_stack.resize(base + native.results);
+            m_ip += 1;
+            break;
+        }
+
+        // Heap instructions take their operands from the stack, addresses are byte offsets
+        case Inst_type::INST_ALLOC: {
+            if (m_stack.empty()) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const f64 size = m_stack.back();
+            const size_t base = (m_heap.size() + 7) & ~static_cast<size_t>(7);
+            if (!(size >= 0) || size > static_cast<f64>(m_heap_limit) ||
+                base + static_cast<size_t>(size) > m_heap_limit) {
+                return Trap::TRAP_OUT_OF_MEMORY;
+            }
+            m_heap.resize(base + static_cast<size_t>(size));
+            m_stack.back() = static_cast<f64>(base);
+            m_ip += 1;
+            break;
+        }
+
+        case Inst_type::INST_LOAD_I64:
+        case Inst_type::INST_LOAD_F64:
+        case Inst_type::INST_LOAD_U8: {
+            if (m_stack.empty()) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const size_t width = inst.type == Inst_type::INST_LOAD_U8 ? 1 : 8;
+            size_t offset = 0;
+            if (!vm_heap_range(m_stack.back(), static_cast<f64>(width), offset)) {
+                return Trap::TRAP_ILLEGAL_MEMORY_ACCESS;
+            }
+            const uint8_t *at = m_heap.data() + offset;
+            if (inst.type == Inst_type::INST_LOAD_I64) {
+                i64 value;
+                std::memcpy(&value, at, sizeof(value));
+                m_stack.back() = static_cast<f64>(value);
+            } else if (inst.type == Inst_type::INST_LOAD_F64) {
+                std::memcpy(&m_stack.back(), at, sizeof(f64));
+            } else {
+                m_stack.back() = *at;
+            }
+            m_ip += 1;
+            break;
+        }
+
+        case Inst_type::INST_STORE_I64:
+        case Inst_type::INST_STORE_F64:
+        case Inst_type::INST_STORE_U8: {
+            if (m_stack.size() < 2) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const size_t width = inst.type == Inst_type::INST_STORE_U8 ? 1 : 8;
+            const f64 value = m_stack.back();
+            size_t offset = 0;
+            if (!vm_heap_range(m_stack[m_stack.size() - 2], static_cast<f64>(width), offset)) {
+                return Trap::TRAP_ILLEGAL_MEMORY_ACCESS;
+            }
+            uint8_t *at = m_heap.data() + offset;
+            if (inst.type == Inst_type::INST_STORE_I64) {
+                const i64 v = static_cast<i64>(value);
+                std::memcpy(at, &v, sizeof(v));
+            } else if (inst.type == Inst_type::INST_STORE_F64) {
+                std::memcpy(at, &value, sizeof(value));
+            } else {
+                *at = static_cast<uint8_t>(static_cast<i64>(value));
+            }
+            m_stack.resize(m_stack.size() - 2);
+            m_ip += 1;
+            break;
+        }
+
+        // Bulk operations go straight to libc, whose routines are already vectorized
+        case Inst_type::INST_MEMCPY:
+        case Inst_type::INST_MEMSET:
+        case Inst_type::INST_MEMCMP: {
+            if (m_stack.size() < 3) {
+                return Trap::TRAP_STACK_UNDERFLOW;
+            }
+            const f64 len = m_stack.back();
+            const f64 b = m_stack[m_stack.size() - 2];
+            const f64 a = m_stack[m_stack.size() - 3];
+            size_t dst = 0;
+            size_t src = 0;
+            if (!vm_heap_range(a, len, dst) ||
+                (inst.type != Inst_type::INST_MEMSET && !vm_heap_range(b, len, src))) {
+                return Trap::TRAP_ILLEGAL_MEMORY_ACCESS;
+            }
+            const auto n = static_cast<size_t>(len);
+            m_stack.resize(m_stack.size() - 3);
+            if (inst.type == Inst_type::INST_MEMCPY) {
+                std::memmove(m_heap.data() + dst, m_heap.data() + src, n); // Overlapping ranges are fine
+            } else if (inst.type == Inst_type::INST_MEMSET) {
+                std::memset(m_heap.data() + dst, static_cast<uint8_t>(static_cast<i64>(b)), n);
+            } else {
+                const int cmp = n == 0 ? 0 : std::memcmp(m_heap.data() + dst, m_heap.data() + src, n);
+                m_stack.emplace_back(cmp < 0 ? -1 : cmp > 0 ? 1 : 0);
+            }
+            m_ip += 1;
+            break;
+        }
+
         case Inst_type::INST_XOR: {
             if (m_stack.size() < 2) {
                 return Trap::TRAP_STACK_UNDERFLOW;
@@ -370,7 +769,7 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
                 }
                 else {
                     auto [index, shift_amount] = std::get<std::pair<i64, i64>>(inst.operand);
-                    if (index < 0 || static_cast<i64>(index) > m_stack.size()) {
+                    if (index < 0 || static_cast<size_t>(index) >= m_stack.size()) {
                         return Trap::TRAP_ILLEGAL_INST_ACCESS;
                     }
                     f64 &value = m_stack.at(m_stack.size() - index - 1);
@@ -395,7 +794,7 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
                 }
                 else {
                     auto [index, shift_amount] = std::get<std::pair<i64, i64>>(inst.operand);
-                    if (index < 0 || static_cast<i64>(index) > m_stack.size()) {
+                    if (index < 0 || static_cast<size_t>(index) >= m_stack.size()) {
                         return Trap::TRAP_ILLEGAL_INST_ACCESS;
                     }
                     f64 &value = m_stack.at(m_stack.size() - index - 1);
@@ -417,71 +816,322 @@ Trap VM::vm_execute_inst(const Instruction &inst) {
         return Trap::TRAP_OK;
 }
 
+Run_result VM::vm_run(const uint64_t max_steps, const std::chrono::microseconds max_time) {
+    const Run_result result = vm_run_loop(max_steps, max_time);
+    m_output.flush();
+    return result;
+}
+
+Run_result VM::vm_run_loop(const uint64_t max_steps, const std::chrono::microseconds max_time) {
+    using Clock = std::chrono::steady_clock;
+    const bool timed = max_time.count() > 0;
+    const Clock::time_point deadline = timed ? Clock::now() + max_time : Clock::time_point::max();
+
+    uint64_t steps = 0;
+    while (!m_halt) {
+        if (steps == max_steps) {
+            return Run_result{Run_status::RUN_YIELDED, Trap::TRAP_OK, steps, Yield_reason::YIELD_STEPS};
+        }
+        const i64 ip = m_ip;
+        if (ip < 0 || static_cast<size_t>(ip) >= m_program.size()) {
+            return Run_result{Run_status::RUN_TRAPPED, Trap::TRAP_ILLEGAL_INST_ACCESS, steps};
+        }
+        const Instruction &inst = m_program[ip];
+        const Trap trap = vm_execute_inst(inst);
+        ++steps;
+        if (trap != Trap::TRAP_OK) {
+            return Run_result{Run_status::RUN_TRAPPED, trap, steps};
+        }
+
+        // Only loops and calls can keep a program running, straight-line code is bounded by its length
+        if (m_ip <= ip || inst.type == Inst_type::INST_CALL) {
+            if (m_interrupt.load(std::memory_order_relaxed)) {
+                m_interrupt.store(false, std::memory_order_relaxed);
+                return Run_result{Run_status::RUN_YIELDED, Trap::TRAP_OK, steps, Yield_reason::YIELD_INTERRUPT};
+            }
+            if (timed && Clock::now() >= deadline) {
+                return Run_result{Run_status::RUN_YIELDED, Trap::TRAP_OK, steps, Yield_reason::YIELD_TIME};
+            }
+        }
+    }
+    return Run_result{Run_status::RUN_HALTED, Trap::TRAP_OK, steps};
+}
+
+void VM::vm_interrupt() noexcept {
+    m_interrupt.store(true, std::memory_order_relaxed);
+}
+
+void VM::vm_clear_interrupt() noexcept {
+    m_interrupt.store(false, std::memory_order_relaxed);
+}
+
+void VM::vm_swap_context(Exec_context &ctx) noexcept {
+    std::swap(m_stack, ctx.stack);
+    std::swap(m_call_stack, ctx.call_stack);
+    std::swap(m_ip, ctx.ip);
+    std::swap(m_halt, ctx.halt);
+    std::swap(m_heap, ctx.heap);
+    std::swap(m_frames, ctx.frames);
+}
+
+bool VM::vm_pop_frame() {
+    if (m_frames.empty() || m_frames.back().depth != m_call_stack.size()) {
+        return true; // The current function has no frame
+    }
+    const Frame &frame = m_frames.back();
+    if (m_stack.size() < frame.base + frame.size) {
+        return false;
+    }
+    const auto base = m_stack.begin() + static_cast<std::ptrdiff_t>(frame.base);
+    m_stack.erase(base, base + static_cast<std::ptrdiff_t>(frame.size));
+    m_frames.pop_back();
+    return true;
+}
+
 void VM::vm_load_program_from_memory(const std::vector<Instruction> &program) {
     std::copy(program.begin(), program.end(), std::back_inserter(m_program));
 }
 
-void VM::vm_load_program_from_file(const std::string &file_name) {
-    std::ifstream file(file_name, std::ios::in | std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << file_name << '\n';
-        return;
-    }
+// Program file written by `bm -o` and read by `bm -i` / bm_program_load. Integers are little-endian:
+//   "BMP" version(u8)  count(u32)  count x { type(u8) tag(u8) operand }  labels(u32)  labels x { name position(u32) }
+// The operand is selected by tag: 0 i64, 1 f64 (bit pattern), 2 string as length(u32) bytes, 3 two i64s.
+// Label names are strings too. Jump targets stay symbolic, so the label table is part of the program.
+namespace {
 
-    m_program.clear();
+constexpr char PROGRAM_MAGIC[3] = {'B', 'M', 'P'};
+constexpr uint8_t PROGRAM_VERSION = 1;
+constexpr Inst_type LAST_INST = Inst_type::INST_TCALL; // Keep in sync with Inst_type
 
-    while (true) {
-        std::underlying_type_t<Inst_type> type_val;
-        i64 operand;
+class Program_writer {
+private:
+    std::string m_bytes{};
 
-        file.read(reinterpret_cast<char *>(&type_val), sizeof(type_val));
-        if (file.eof()) break;
+public:
+    void u8(const uint8_t value) { m_bytes.push_back(static_cast<char>(value)); }
+    void u32(const uint32_t value) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            u8(static_cast<uint8_t>(value >> shift));
+        }
+    }
+    void u64(const uint64_t value) {
+        for (int shift = 0; shift < 64; shift += 8) {
+            u8(static_cast<uint8_t>(value >> shift));
+        }
+    }
+    void str(const std::string &value) {
+        u32(static_cast<uint32_t>(value.size()));
+        m_bytes += value;
+    }
+    const std::string &bytes() const { return m_bytes; }
+};
 
-        if (!file) {
-            std::cerr << "Error reading instruction type from file.\n";
-            break;
+// Every read checks the remaining length, so a truncated or crafted file fails instead of over-reading
+class Program_reader {
+private:
+    const std::string &m_bytes;
+    size_t m_pos{};
+
+public:
+    explicit Program_reader(const std::string &bytes) : m_bytes(bytes) {}
+
+    bool u8(uint8_t &value) {
+        if (m_pos >= m_bytes.size()) {
+            return false;
+        }
+        value = static_cast<uint8_t>(m_bytes[m_pos++]);
+        return true;
+    }
+    bool u32(uint32_t &value) {
+        uint64_t wide{};
+        if (!bytes_le(4, wide)) {
+            return false;
+        }
+        value = static_cast<uint32_t>(wide);
+        return true;
+    }
+    bool u64(uint64_t &value) { return bytes_le(8, value); }
+    bool bytes_le(const int count, uint64_t &value) {
+        if (m_bytes.size() - m_pos < static_cast<size_t>(count)) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < count; ++i) {
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(m_bytes[m_pos++])) << (8 * i);
+        }
+        return true;
+    }
+    bool str(std::string &value) {
+        uint32_t size{};
+        if (!u32(size) || m_bytes.size() - m_pos < size) {
+            return false;
         }
+        value = m_bytes.substr(m_pos, size);
+        m_pos += size;
+        return true;
+    }
+    bool at_end() const { return m_pos == m_bytes.size(); }
+};
+
+} // namespace
 
-        file.read(reinterpret_cast<char *>(&operand), sizeof(operand));
-        if (file.eof()) break;
+bool VM::vm_load_program_from_file(const std::string &file_name) {
+    std::ifstream file(file_name, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        return vm_asm_error("Failed to open file: " + file_name);
+    }
+    const std::string bytes{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    if (file.bad()) {
+        return vm_asm_error("Error reading program file: " + file_name);
+    }
 
-        if (!file) {
-            std::cerr << "Error reading instruction operand from file.\n";
+    Program_reader in(bytes);
+    char magic[3]{};
+    uint8_t version{};
+    for (char &c : magic) {
+        uint8_t byte{};
+        if (!in.u8(byte)) {
             break;
         }
+        c = static_cast<char>(byte);
+    }
+    if (std::memcmp(magic, PROGRAM_MAGIC, sizeof(magic)) != 0 || !in.u8(version)) {
+        return vm_asm_error("Not a bm program file: " + file_name);
+    }
+    if (version != PROGRAM_VERSION) {
+        return vm_asm_error("Unsupported program file version " + std::to_string(version) + ".");
+    }
 
-        auto inst_type = static_cast<Inst_type>(type_val);
-        m_program.emplace_back(Instruction{.type = inst_type, .operand = operand});
+    uint32_t count{};
+    if (!in.u32(count)) {
+        return vm_asm_error("Program file is truncated.");
     }
+    std::vector<Instruction> program{};
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t type{}, tag{};
+        if (!in.u8(type) || !in.u8(tag)) {
+            return vm_asm_error("Program file is truncated.");
+        }
+        // INST_BREAK only ever exists as a debugger patch
+        if (type > static_cast<uint8_t>(LAST_INST) || static_cast<Inst_type>(type) == Inst_type::INST_BREAK) {
+            return vm_asm_error("Invalid opcode " + std::to_string(type) + " at " + std::to_string(i) + ".");
+        }
 
-    file.close();
-    std::cout << "Program successfully loaded from " << file_name << '\n';
-}
+        Operand operand{};
+        uint64_t a{}, b{};
+        std::string label{};
+        bool ok = true;
+        switch (tag) {
+            case 0:
+                ok = in.u64(a);
+                operand = static_cast<i64>(a);
+                break;
+            case 1: {
+                ok = in.u64(a);
+                f64 value;
+                std::memcpy(&value, &a, sizeof(value));
+                operand = value;
+                break;
+            }
+            case 2:
+                ok = in.str(label);
+                operand = std::move(label);
+                break;
+            case 3:
+                ok = in.u64(a) && in.u64(b);
+                operand = std::make_pair(static_cast<i64>(a), static_cast<i64>(b));
+                break;
+            default:
+                return vm_asm_error("Invalid operand tag " + std::to_string(tag) + " at " + std::to_string(i) + ".");
+        }
+        if (!ok) {
+            return vm_asm_error("Program file is truncated.");
+        }
+        program.emplace_back(Instruction{.type = static_cast<Inst_type>(type), .operand = std::move(operand)});
+    }
 
-void VM::vm_save_program_to_file(const std::string &file_path) {
-    std::ofstream file(file_path, std::ios::out | std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file to save program to: " << file_path << '\n';
-        return;
+    uint32_t label_count{};
+    if (!in.u32(label_count)) {
+        return vm_asm_error("Program file is truncated.");
+    }
+    std::unordered_map<std::string, int> labels{};
+    for (uint32_t i = 0; i < label_count; ++i) {
+        std::string name{};
+        uint32_t position{};
+        if (!in.str(name) || !in.u32(position)) {
+            return vm_asm_error("Program file is truncated.");
+        }
+        // A label may point one past the last instruction, where running traps like any other bad ip
+        if (position > program.size()) {
+            return vm_asm_error("Label '" + name + "' is out of range.");
+        }
+        labels[name] = static_cast<int>(position);
+    }
+    if (!in.at_end()) {
+        return vm_asm_error("Trailing data in program file.");
     }
 
+    m_program = std::move(program);
+    m_labels = std::move(labels);
+    return true;
+}
+
+bool VM::vm_save_program_to_file(const std::string &file_path) {
     if (m_program.empty()) {
-        std::cerr << "Error: Program is empty, nothing to save.\n";
-        file.close();
-        return;
+        return vm_asm_error("Program is empty, nothing to save.");
     }
 
+    Program_writer out;
+    for (const char c : PROGRAM_MAGIC) {
+        out.u8(static_cast<uint8_t>(c));
+    }
+    out.u8(PROGRAM_VERSION);
+    out.u32(static_cast<uint32_t>(m_program.size()));
     for (const auto &inst : m_program) {
-        auto type_val = static_cast<std::underlying_type_t<Inst_type>>(inst.type);
-        file.write(reinterpret_cast<const char *>(&type_val), sizeof(type_val));
-        file.write(reinterpret_cast<const char *>(&inst.operand), sizeof(inst.operand));
+        out.u8(static_cast<uint8_t>(inst.type));
+        if (std::holds_alternative<i64>(inst.operand)) {
+            out.u8(0);
+            out.u64(static_cast<uint64_t>(std::get<i64>(inst.operand)));
+        } else if (std::holds_alternative<f64>(inst.operand)) {
+            const f64 value = std::get<f64>(inst.operand);
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            out.u8(1);
+            out.u64(bits);
+        } else if (std::holds_alternative<std::string>(inst.operand)) {
+            out.u8(2);
+            out.str(std::get<std::string>(inst.operand));
+        } else {
+            const auto &[a, b] = std::get<std::pair<i64, i64>>(inst.operand);
+            out.u8(3);
+            out.u64(static_cast<uint64_t>(a));
+            out.u64(static_cast<uint64_t>(b));
+        }
     }
-    
-    file.close();
-    std::cout << "Program successfully saved to " << file_path << '\n';
+
+    // Sorted so the same program always produces the same file
+    std::vector<std::pair<std::string, int>> labels{};
+    if (m_labels.has_value()) {
+        labels.assign(m_labels->begin(), m_labels->end());
+        std::sort(labels.begin(), labels.end());
+    }
+    out.u32(static_cast<uint32_t>(labels.size()));
+    for (const auto &[name, position] : labels) {
+        out.str(name);
+        out.u32(static_cast<uint32_t>(position));
+    }
+
+    std::ofstream file(file_path, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        return vm_asm_error("Failed to open file to save program to: " + file_path);
+    }
+    file.write(out.bytes().data(), static_cast<std::streamsize>(out.bytes().size()));
+    if (!file) {
+        return vm_asm_error("Error writing program to: " + file_path);
+    }
+    return true;
 }
 
-void VM::vm_translate_asm() {
+bool VM::vm_translate_asm() {
     std::vector<std::string> lines{};
 
     // Tokenize m_memory into words
@@ -538,18 +1188,21 @@ void VM::vm_translate_asm() {
             continue;
         } else if (lines[i] == "#") {
             if (i + 3 >= lines.size() || lines[i + 1] != "define") {
-                std::cerr << "Error: Invalid macro definition. Expected format: # define MACRO_NAME VALUE\n";
-                exit(1);
+                return vm_asm_error("Invalid macro definition. Expected format: # define MACRO_NAME VALUE");
             }
             const std::string &macro_name = lines[i + 2];
             const std::string &macro_value = lines[i + 3];
             ++i; // For skipping 'define'
 
             if (isdigit(macro_value[0]) || macro_value[0] == '-') {
-                if (macro_value.find('.') != std::string::npos) {
-                    (*m_macros)[macro_name] = std::stod(macro_value);
-                } else {
-                    (*m_macros)[macro_name] = std::stoi(macro_value);
+                try {
+                    if (macro_value.find('.') != std::string::npos) {
+                        (*m_macros)[macro_name] = std::stod(macro_value);
+                    } else {
+                        (*m_macros)[macro_name] = std::stoi(macro_value);
+                    }
+                } catch (const std::logic_error &e) {
+                    return vm_asm_error(std::string("Invalid value for macro '") + macro_name + "': " + e.what());
                 }
             } else {
                 (*m_macros)[macro_name] = macro_value;
@@ -560,8 +1213,7 @@ void VM::vm_translate_asm() {
             m_program.emplace_back(inst);
         }else if (lines[i] == "push") {
             if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'push' missing operand.\n";
-                exit(1);
+                return vm_asm_error("'push' missing operand.");
             }
 
             // Check if the operand is a macro
@@ -573,51 +1225,48 @@ void VM::vm_translate_asm() {
                 } else if (std::holds_alternative<double>(macro_value)) {
                     inst = inst_push(std::get<double>(macro_value));
                 } else {
-                    std::cerr << "Error: Macro '" << operand << "' cannot be used as a numeric operand for 'push'.\n";
-                    exit(1);
+                    return vm_asm_error(std::string("Macro '") + operand + "' cannot be used as a numeric operand for 'push'.");
                 }
             } else {
                 // Handle direct numeric values
                 if (operand.find('.') != std::string::npos) {
                     try {
                         inst = inst_push(std::stod(operand));
-                    } catch (const std::invalid_argument &) {
-                        std::cerr << "Error: Invalid floating-point value for 'push': " << operand << '\n';
-                        exit(1);
+                    } catch (const std::logic_error &) {
+                        return vm_asm_error(std::string("Invalid floating-point value for 'push': ") + operand);
                     }
                 } else {
                     try {
                         inst = inst_push(static_cast<i64>(std::stoi(operand))); // Use std::stoi and cast to i64
-                    } catch (const std::invalid_argument &) {
-                        std::cerr << "Error: Invalid integer value for 'push': " << operand << '\n';
-                        exit(1);
+                    } catch (const std::logic_error &) {
+                        return vm_asm_error(std::string("Invalid integer value for 'push': ") + operand);
                     }
                 }
             }
             m_program.emplace_back(inst);
             ++i; // Skip the operand
         } else if (lines[i] == "swap") {
+            if (i + 1 >= lines.size()) {
+                return vm_asm_error("'swap' missing operand.");
+            }
             int operand{};
             try {
                 operand = std::stoi(lines.at(i + 1));
-            } catch (const std::invalid_argument &e) {
-                std::cerr << "Error: swap has invalid operand. " << e.what() << '\n';
-                exit(1);
+            } catch (const std::logic_error &e) {
+                return vm_asm_error(std::string("swap has invalid operand. ") + e.what());
             }
             inst = inst_swap(operand);
             m_program.emplace_back(inst);
             ++i;
         } else if (lines[i] == "dup") {
             if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'dup' missing operand.\n";
-                exit(1);
+                return vm_asm_error("'dup' missing operand.");
             }
             int val{};
             try {
                 val = std::stoi(lines.at(i + 1));
-            } catch (const std::invalid_argument &e) {
-                std::cerr << "Failed to parse operand for 'dup': " << e.what() << '\n';
-                exit(1);
+            } catch (const std::logic_error &e) {
+                return vm_asm_error(std::string("Failed to parse operand for 'dup': ") + e.what());
             }
             inst = inst_dup(val);
             m_program.emplace_back(inst);
@@ -639,13 +1288,15 @@ void VM::vm_translate_asm() {
             m_program.emplace_back(inst);
         } else if (lines[i] == "jmp") {
             if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'jmp' missing operand.\n";
-                exit(1);
+                return vm_asm_error("'jmp' missing operand.");
             }
             const std::string &operand = lines[i + 1];
             if (std::isdigit(operand[0])) {
-                int addr = std::stoi(operand);
-                inst = inst_jmp(addr);
+                try {
+                    inst = inst_jmp(static_cast<i64>(std::stoi(operand)));
+                } catch (const std::logic_error &e) {
+                    return vm_asm_error(std::string("Invalid address for 'jmp': ") + e.what());
+                }
             } else {
                 inst = inst_jmp(operand);
             }
@@ -653,8 +1304,7 @@ void VM::vm_translate_asm() {
             ++i;
         } else if (lines[i] == "jmp_if") {
             if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'jmp_if' missing operand.\n";
-                exit(1);
+                return vm_asm_error("'jmp_if' missing operand.");
             }
             const std::string &operand = lines[i + 1];
             inst = Instruction{.type = Inst_type::INST_JMP_IF, .operand = operand};
@@ -664,6 +1314,9 @@ void VM::vm_translate_asm() {
         else if (lines[i] == "not") {
             inst = inst_not();
             m_program.emplace_back(inst);
+        } else if (lines[i] == "print_debug") {
+            inst = inst_print_debug();
+            m_program.emplace_back(inst);
         } else if (lines[i] == "halt") {
             inst = inst_halt();
             m_program.emplace_back(inst);
@@ -672,13 +1325,114 @@ void VM::vm_translate_asm() {
             m_program.emplace_back(inst);
         } else if (lines[i] == "call") {
             if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'call' missing operand.\n";
-                exit(1);
+                return vm_asm_error("'call' missing operand.");
             }
             const std::string &operand = lines[i + 1];
             inst = inst_call(operand);
             m_program.emplace_back(inst);
             i += 1;
+        } else if (lines[i] == "tcall") {
+            if (i + 1 >= lines.size()) {
+                return vm_asm_error("'tcall' missing operand.");
+            }
+            inst = inst_tcall(lines[i + 1]);
+            m_program.emplace_back(inst);
+            i += 1;
+        } else if (lines[i] == "enter") {
+            if (i + 2 >= lines.size()) {
+                return vm_asm_error("'enter' missing operand.");
+            }
+            i64 args {}, locals {};
+            try {
+                args = std::stoi(lines[i + 1]);
+                locals = std::stoi(lines[i + 2]);
+            } catch (const std::logic_error &e) {
+                return vm_asm_error(std::string("Invalid integer value for 'enter': ") + e.what());
+            }
+            if (args < 0 || locals < 0) {
+                return vm_asm_error("'enter' counts must not be negative.");
+            }
+            inst = inst_enter(args, locals);
+            m_program.emplace_back(inst);
+            i += 2;
+        } else if (lines[i] == "load_local" || lines[i] == "store_local") {
+            if (i + 1 >= lines.size()) {
+                return vm_asm_error("'" + lines[i] + "' missing operand.");
+            }
+            i64 index {};
+            try {
+                index = std::stoi(lines[i + 1]);
+            } catch (const std::logic_error &e) {
+                return vm_asm_error("Invalid integer value for '" + lines[i] + "': " + e.what());
+            }
+            inst = lines[i] == "load_local" ? inst_load_local(index) : inst_store_local(index);
+            m_program.emplace_back(inst);
+            i += 1;
+        } else if (lines[i] == "spawn") {
+            if (i + 1 >= lines.size()) {
+                return vm_asm_error("'spawn' missing operand.");
+            }
+            inst = inst_spawn(lines[i + 1]);
+            m_program.emplace_back(inst);
+            i += 1;
+        } else if (lines[i] == "yield") {
+            inst = inst_yield();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "join") {
+            inst = inst_join();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "chan") {
+            inst = inst_chan();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "send") {
+            inst = inst_send();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "recv") {
+            inst = inst_recv();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "native") {
+            if (i + 1 >= lines.size()) {
+                return vm_asm_error("'native' missing operand.");
+            }
+            const std::string &name = lines[i + 1];
+            const auto it = std::find_if(m_natives.begin(), m_natives.end(),
+                                         [&name](const Native &n) { return n.name == name; });
+            if (it == m_natives.end()) {
+                return vm_asm_error("Unknown native function '" + name + "'.");
+            }
+            inst = inst_native(it - m_natives.begin());
+            m_program.emplace_back(inst);
+            i += 1;
+        } else if (lines[i] == "alloc") {
+            inst = inst_alloc();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "load_i64") {
+            inst = inst_load_i64();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "load_f64") {
+            inst = inst_load_f64();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "load_u8") {
+            inst = inst_load_u8();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "store_i64") {
+            inst = inst_store_i64();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "store_f64") {
+            inst = inst_store_f64();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "store_u8") {
+            inst = inst_store_u8();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "memcpy") {
+            inst = inst_memcpy();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "memset") {
+            inst = inst_memset();
+            m_program.emplace_back(inst);
+        } else if (lines[i] == "memcmp") {
+            inst = inst_memcmp();
+            m_program.emplace_back(inst);
         } else if (lines[i] == "xor") {
             inst = inst_xor();
             m_program.emplace_back(inst);
@@ -689,8 +1443,8 @@ void VM::vm_translate_asm() {
             inst = inst_or();
             m_program.emplace_back(inst);
         } else if (lines[i] == "shl") {
-            if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'shr' missing operand.\n";
+            if (i + 2 >= lines.size()) {
+                return vm_asm_error("'shl' missing operand");
             } else {
                 const std::string &indx = lines[i + 1];
                 const std::string &value = lines[i + 2];
@@ -698,17 +1452,16 @@ void VM::vm_translate_asm() {
                 try {
                     i_val= std::stoi(indx);
                     v_val = std::stoi(value);
-                } catch (const std::invalid_argument &e) {
-                    std::cerr << "Error: Invalid integer value for 'shr': " << e.what() << '\n';
-                    exit(1);
+                } catch (const std::logic_error &e) {
+                    return vm_asm_error(std::string("Invalid integer value for 'shl': ") + e.what());
                 }
                 inst = inst_shl(i_val, v_val);
                 m_program.emplace_back(inst);
                 i += 2;
             }
         } else if (lines[i] == "shr") {
-            if (i + 1 >= lines.size()) {
-                std::cerr << "Error: 'shr' missing operand.\n";
+            if (i + 2 >= lines.size()) {
+                return vm_asm_error("'shr' missing operand");
             } else {
                 const std::string &indx = lines[i + 1];
                 const std::string &value = lines[i + 2];
@@ -716,9 +1469,8 @@ void VM::vm_translate_asm() {
                 try {
                     i_val= std::stoi(indx);
                     v_val = std::stoi(value);
-                } catch (const std::invalid_argument &e) {
-                    std::cerr << "Error: Invalid integer value for 'shr': " << e.what() << '\n';
-                    exit(1);
+                } catch (const std::logic_error &e) {
+                    return vm_asm_error(std::string("Invalid integer value for 'shr': ") + e.what());
                 }
                 inst = inst_shr(i_val, v_val);
                 m_program.emplace_back(inst);
@@ -726,19 +1478,92 @@ void VM::vm_translate_asm() {
             }
         }
         else {
-            std::cerr << "Unknown instruction: " << lines[i] << '\n';
-            exit(1);
+            return vm_asm_error(std::string("Unknown instruction: ") + lines[i]);
         }
     }
+    vm_optimize_tail_calls();
+    return true;
 }
 
-void VM::vm_dump_stack() const {
-    std::cout << "Stack:\n";
+size_t VM::vm_optimize_tail_calls() {
+    if (!m_labels.has_value()) {
+        return 0;
+    }
+    // Dropping the caller's frame early is only invisible if the callee sticks to its own
+    // frame, which we take an `enter` at its entry to promise. Frameless programs are always safe.
+    const bool has_frames = std::any_of(m_program.begin(), m_program.end(),
+                                        [](const Instruction &inst) { return inst.type == Inst_type::INST_ENTER; });
+    size_t count = 0;
+    for (size_t ip = 0; ip + 1 < m_program.size(); ++ip) {
+        Instruction &inst = m_program[ip];
+        if (inst.type != Inst_type::INST_CALL || m_program[ip + 1].type != Inst_type::INST_RET ||
+            !std::holds_alternative<std::string>(inst.operand)) {
+            continue;
+        }
+        const auto target = m_labels->find(std::get<std::string>(inst.operand));
+        if (target == m_labels->end()) {
+            continue; // Leave the trap to run time
+        }
+        const bool callee_framed = target->second >= 0 && static_cast<size_t>(target->second) < m_program.size() &&
+                                   m_program[target->second].type == Inst_type::INST_ENTER;
+        if (has_frames && !callee_framed) {
+            continue;
+        }
+        inst.type = Inst_type::INST_TCALL;
+        ++count;
+    }
+    return count;
+}
+
+bool VM::vm_asm_error(const std::string &message) {
+    m_error = message;
+    return false;
+}
+
+void VM::vm_dump_stack() {
+    m_output.write("Stack:\n");
     if(!m_stack.empty()) {
-        for (size_t i = 0; i < m_stack.size(); ++i) {
-            std::cout << "  " << m_stack.at(i) << '\n';
+        for (const f64 value : m_stack) {
+            m_output.write("  ");
+            m_output.write_number(value);
+            m_output.write("\n");
         }
     } else {
-        std::cout << "[empty]\n";
+        m_output.write("[empty]\n");
+    }
+    m_output.flush();
+}
+
+void VM::vm_dump_state(std::ostream &out) const {
+    out << "ip: " << m_ip;
+    if (m_ip >= 0 && static_cast<size_t>(m_ip) < m_program.size()) {
+        out << " (" << inst_as_str(m_program.at(m_ip).type) << ')';
+    }
+    out << '\n';
+    if (!m_heap.empty()) {
+        out << "Heap: " << m_heap.size() << " bytes allocated\n";
+    }
+
+    if constexpr (VM_trace::enabled) {
+        out << "Trace (last " << std::min<uint64_t>(BM_TRACE_DEPTH, m_trace.count()) << " of " << m_trace.count() << "):\n";
+        m_trace.for_each([&out](const Trace_entry &e) {
+            out << "  " << e.ip << '\t' << inst_as_str(e.type) << "\ttop=" << e.top << '\n';
+        });
+    }
+
+    out << "Stack:\n";
+    if (m_stack.empty()) {
+        out << "  [empty]\n";
+    }
+    for (size_t i = 0; i < m_stack.size(); ++i) {
+        out << "  " << m_stack.at(i) << '\n';
+    }
+
+    out << "Call stack:\n";
+    if (m_call_stack.empty()) {
+        out << "  [empty]\n";
+    }
+    for (size_t i = m_call_stack.size(); i-- > 0;) {
+        out << "  " << m_call_stack.at(i) << '\n';
     }
 }
@@ -0,0 +1,129 @@
+// Save/load round trip through the C API: a program written with bm_program_save
+// must run exactly like the assembled original, and malformed files must be rejected.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "bm.h"
+
+namespace {
+
+// Labels (call, jmp_if, tcall), f64 and pair operands, and a native index
+const char SOURCE[] = R"(
+start:
+    push 1.5
+    push 10
+    push 0
+    call sum
+    push 7
+    shl 0 2
+    push 2
+    native sqrt
+    halt
+sum:
+    enter 2 0
+    load_local 0
+    not
+    jmp_if done
+    load_local 0
+    push 1
+    minus
+    load_local 1
+    load_local 0
+    plus
+    call sum
+    ret
+done:
+    load_local 1
+    ret
+)";
+
+int failures = 0;
+
+void expect(const bool ok, const char *what) {
+    if (!ok) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+bool run(const bm_program *program, std::string &stack) {
+    bm_context *ctx = nullptr;
+    if (bm_context_create(program, &ctx) != BM_OK) {
+        return false;
+    }
+    const bm_status status = bm_run(ctx, 1'000'000, nullptr);
+    stack.clear();
+    for (size_t i = 0; i < bm_stack_size(ctx); ++i) {
+        double value = 0;
+        (void)bm_stack_get(ctx, i, &value);
+        stack += std::to_string(value) + ' ';
+    }
+    bm_context_free(ctx);
+    return status == BM_OK;
+}
+
+void write_file(const std::string &path, const std::string &bytes) {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    std::fwrite(bytes.data(), 1, bytes.size(), file);
+    std::fclose(file);
+}
+
+std::string read_file(const std::string &path) {
+    std::string bytes;
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    for (int c; file != nullptr && (c = std::fgetc(file)) != EOF;) {
+        bytes.push_back(static_cast<char>(c));
+    }
+    if (file != nullptr) {
+        std::fclose(file);
+    }
+    return bytes;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const std::string path = argc > 1 ? argv[1] : "capi_roundtrip.bmp";
+    char err[256] = {};
+
+    bm_program *original = nullptr;
+    if (bm_program_assemble(SOURCE, sizeof(SOURCE) - 1, &original, err, sizeof(err)) != BM_OK) {
+        std::fprintf(stderr, "assemble: %s\n", err);
+        return EXIT_FAILURE;
+    }
+    expect(bm_program_save(original, path.c_str(), err, sizeof(err)) == BM_OK, "save");
+
+    bm_program *loaded = nullptr;
+    expect(bm_program_load(path.c_str(), &loaded, err, sizeof(err)) == BM_OK, "load");
+
+    std::string want, got;
+    expect(run(original, want), "original halts");
+    expect(loaded != nullptr && run(loaded, got), "loaded halts");
+    expect(want == got, "loaded program leaves the same stack");
+    expect(want == "1.500000 55.000000 28.000000 1.414214 ", "expected stack");
+
+    // Saving the loaded program again gives the same bytes
+    const std::string copy = path + ".copy";
+    expect(loaded != nullptr && bm_program_save(loaded, copy.c_str(), err, sizeof(err)) == BM_OK, "save again");
+    const std::string bytes = read_file(path);
+    expect(!bytes.empty() && bytes == read_file(copy), "stable encoding");
+
+    // Malformed files: truncated, a debugger-only opcode, an unknown operand tag, trailing data
+    const size_t first_inst = 8; // Magic, version and instruction count
+    std::string bad[4] = {bytes.substr(0, bytes.size() - 1), bytes, bytes, bytes + '\0'};
+    bad[1][first_inst] = 22; // INST_BREAK
+    bad[2][first_inst + 1] = 9;
+    for (const std::string &file : bad) {
+        write_file(copy, file);
+        bm_program *rejected = nullptr;
+        expect(bm_program_load(copy.c_str(), &rejected, err, sizeof(err)) == BM_ERR_IO, "malformed file rejected");
+        bm_program_free(rejected);
+    }
+
+    std::remove(path.c_str());
+    std::remove(copy.c_str());
+    bm_program_free(original);
+    bm_program_free(loaded);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}